@@ -0,0 +1,488 @@
+/*
+	packbench
+	Benchmarks and regression-tests the exhal / inhal (de)compression routines using
+	either the level maps and tilesets from a Kirby's Adventure ROM, or a synthetic set
+	of similar data if no ROM is given.
+
+	Usage: packbench [-n iterations] [-b baseline] [rom.nes]
+
+	If a baseline file is given and doesn't exist yet, the checksums of the compressed data
+	for each mode are saved to it. If it does exist, the checksums are compared to it and
+	the benchmark fails if anything changed. Without a baseline file, the synthetic data is
+	compared to the built-in checksums below instead.
+
+	This code is released under the terms of the MIT license.
+	See COPYING.txt for details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compress.h"
+#include "matchlen.h"
+
+// locations of compressed data pointer tables (same as in level.cpp and tileset.cpp)
+#define NUM_LEVELS   0x147
+#define NUM_TILESETS 0x31
+
+#define BANK_SIZE   0x2000
+#define HEADER_SIZE 16
+
+// size of one screen of tiles in a level map (same as in tilemap.h)
+#define SCREEN_SIZE (12 * 16)
+
+typedef struct {
+	unsigned bank, addr;
+} romaddr_t;
+
+static const romaddr_t ptrMapDataL = {0x12, 0x88a6};
+static const romaddr_t ptrMapDataH = {0x12, 0x875f};
+static const romaddr_t ptrMapDataB = {0x12, 0x84d1};
+static const romaddr_t ptrTilesetL = {0x12, 0x8a4f};
+static const romaddr_t ptrTilesetH = {0x12, 0x8a1e};
+static const romaddr_t ptrTilesetB = {0x12, 0x89ed};
+
+#define MAX_CHUNKS (NUM_LEVELS + NUM_TILESETS)
+
+// one piece of uncompressed data to test with
+typedef struct {
+	uint8_t *data;
+	size_t   size;
+} chunk_t;
+
+// compression modes to test
+static const struct {
+	int         mode;
+	const char *name;
+	// checksum of all compressed synthetic data
+	uint32_t    synthetic;
+} modes[] = {
+	{ PACK_FAST,        "fast",        0x59c5d4fe },
+	{ PACK_NORMAL,      "normal",      0x1d11c107 },
+	{ PACK_OPTIMAL,     "optimal",     0x26bb83ec },
+	{ PACK_FAST_DECODE, "fast decode", 0xbc7b0e0e },
+};
+#define NUM_MODES (sizeof(modes) / sizeof(modes[0]))
+
+static const char *methodNames[7] = {
+	"No compression",
+	"RLE (8-bit)",
+	"RLE (16-bit)",
+	"RLE (sequence)",
+	"Backref (normal)",
+	"Backref (rotate)",
+	"Backref (reverse)"
+};
+
+// Converts a MMC3 address to a file offset (same as ROMFile::toOffset)
+static size_t to_offset (romaddr_t addr) {
+	return (addr.addr % BANK_SIZE) + ((addr.bank & 0x7F) * BANK_SIZE) + HEADER_SIZE;
+}
+
+// Reads a 24-bit pointer from a set of pointer tables (same as ROMFile::readPointer)
+static romaddr_t read_pointer (const uint8_t *rom, size_t romsize,
+                               romaddr_t addrL, romaddr_t addrH, romaddr_t addrB, unsigned num) {
+	romaddr_t addr = { 0, 0 };
+	size_t offL = to_offset(addrL) + num;
+	size_t offH = to_offset(addrH) + num;
+	size_t offB = to_offset(addrB) + num;
+
+	if (offL < romsize && offH < romsize && offB < romsize) {
+		addr.bank = rom[offB] & 0x7F;
+		addr.addr = rom[offH] * 256u + rom[offL];
+	}
+	return addr;
+}
+
+// Decompresses every chunk of data from one set of pointer tables.
+static size_t load_rom_chunks (const uint8_t *rom, size_t romsize, chunk_t *chunks, unsigned count,
+                               romaddr_t addrL, romaddr_t addrH, romaddr_t addrB) {
+	size_t loaded = 0;
+	uint8_t *buf = (uint8_t*)malloc(DATA_SIZE);
+
+	for (unsigned i = 0; i < count; i++) {
+		romaddr_t addr = read_pointer(rom, romsize, addrL, addrH, addrB, i);
+		size_t offset = to_offset(addr);
+		if (!addr.addr || offset >= romsize) continue;
+
+		size_t size = unpack_bounded(rom + offset, romsize - offset, buf, DATA_SIZE, NULL);
+		if (!size) continue;
+
+		chunks[loaded].data = (uint8_t*)malloc(size);
+		chunks[loaded].size = size;
+		memcpy(chunks[loaded].data, buf, size);
+		loaded++;
+	}
+
+	free(buf);
+	return loaded;
+}
+
+// Loads all level maps and tilesets from a ROM.
+static size_t load_rom (const char *path, chunk_t *chunks) {
+	FILE *file = fopen(path, "rb");
+	if (!file) return 0;
+
+	fseek(file, 0, SEEK_END);
+	size_t romsize = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	uint8_t *rom = (uint8_t*)malloc(romsize);
+	size_t loaded = 0;
+	if (rom && fread(rom, 1, romsize, file) == romsize) {
+		loaded  = load_rom_chunks(rom, romsize, chunks, NUM_LEVELS,
+		                          ptrMapDataL, ptrMapDataH, ptrMapDataB);
+		loaded += load_rom_chunks(rom, romsize, chunks + loaded, NUM_TILESETS,
+		                          ptrTilesetL, ptrTilesetH, ptrTilesetB);
+	}
+
+	free(rom);
+	fclose(file);
+	return loaded;
+}
+
+// small deterministic random number generator for the synthetic data
+static uint32_t seed;
+static uint32_t rnd (uint32_t range) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % range;
+}
+
+// Generates data which looks vaguely like level maps and tilesets:
+// lots of runs, repeated and mirrored strings, and a small set of distinct values.
+static void make_synthetic (uint8_t *buf, size_t size) {
+	size_t pos = 0;
+
+	while (pos < size) {
+		size_t len = 1 + rnd(48);
+		if (pos + len > size) len = size - pos;
+
+		// (start with a run, since there's nothing to repeat yet)
+		switch (pos ? rnd(6) : 0) {
+		// 8-bit run
+		case 0: {
+			uint8_t value = rnd(256);
+			memset(buf + pos, value, len);
+			break;
+		}
+		// increasing sequence
+		case 1: {
+			uint8_t value = rnd(256);
+			for (size_t i = 0; i < len; i++)
+				buf[pos + i] = value + i;
+			break;
+		}
+		// repeated string
+		case 2: {
+			size_t from = rnd(pos);
+			for (size_t i = 0; i < len; i++)
+				buf[pos + i] = buf[from + i];
+			break;
+		}
+		// string with its bits reversed
+		case 3: {
+			size_t from = rnd(pos);
+			for (size_t i = 0; i < len; i++) {
+				uint8_t in = buf[from + i], out = 0;
+				for (int bit = 0; bit < 8; bit++)
+					if (in & (1 << bit)) out |= 0x80 >> bit;
+				buf[pos + i] = out;
+			}
+			break;
+		}
+		// 16-bit run
+		case 4: {
+			uint8_t a = rnd(256), b = rnd(256);
+			for (size_t i = 0; i < len; i++)
+				buf[pos + i] = (i & 1) ? b : a;
+			break;
+		}
+		// assorted metatiles
+		default:
+			for (size_t i = 0; i < len; i++)
+				buf[pos + i] = rnd(24);
+		}
+
+		pos += len;
+	}
+}
+
+// Generates the same number of level maps and tilesets as in the game.
+static size_t load_synthetic (chunk_t *chunks) {
+	size_t loaded = 0;
+	seed = 0x4B414C45;
+
+	for (unsigned i = 0; i < NUM_LEVELS; i++) {
+		// header and screen list, plus between 1 and 16 screens
+		size_t size = 0xDA + SCREEN_SIZE * (1 + rnd(16));
+		chunks[loaded].data = (uint8_t*)malloc(size);
+		chunks[loaded].size = size;
+		make_synthetic(chunks[loaded].data, size);
+		loaded++;
+	}
+	for (unsigned i = 0; i < NUM_TILESETS; i++) {
+		chunks[loaded].data = (uint8_t*)malloc(0x540);
+		chunks[loaded].size = 0x540;
+		make_synthetic(chunks[loaded].data, 0x540);
+		loaded++;
+	}
+
+	return loaded;
+}
+
+// FNV-1a hash of compressed data, used to detect any changes in the output
+static uint32_t checksum (uint32_t hash, const uint8_t *data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+// Counts how many times each compression method is used in some compressed data.
+static void count_methods (const uint8_t *packed, size_t size, unsigned long *counts) {
+	size_t pos = 0;
+
+	while (pos < size && packed[pos] != 0xFF) {
+		uint8_t  input = packed[pos++];
+		unsigned command, length;
+
+		if ((input & 0xE0) == 0xE0) {
+			command = (input >> 2) & 0x07;
+			length = (((input & 0x03) << 8) | packed[pos++]) + 1;
+		} else {
+			command = input >> 5;
+			length = (input & 0x1F) + 1;
+		}
+		if (command == 7) command = 4;
+
+		switch (command) {
+		case 0:  pos += length; break;
+		case 1:
+		case 3:  pos += 1; break;
+		default: pos += 2;
+		}
+
+		counts[command]++;
+	}
+}
+
+// Packs short inputs (and the end of the synthetic data) from exactly-sized heap buffers
+// in every mode, so reading past the end of the input can be caught by ASan, valgrind, etc.
+static int check_short_inputs (const chunk_t *chunks, size_t numChunks, pack_scratch_t *scratch) {
+	uint8_t *packed = (uint8_t*)malloc(DATA_SIZE);
+	uint8_t *unpacked = (uint8_t*)malloc(DATA_SIZE);
+	int failed = 0;
+
+	for (size_t m = 0; m < NUM_MODES; m++) {
+		for (size_t size = 1; size <= 64; size++) {
+			// take the last bytes of each chunk in turn
+			const chunk_t *chunk = &chunks[size % numChunks];
+			if (chunk->size < size) continue;
+
+			uint8_t *input = (uint8_t*)malloc(size);
+			memcpy(input, chunk->data + chunk->size - size, size);
+
+			size_t packedSize = pack_with_scratch(input, size, packed, modes[m].mode, scratch);
+			if (!packedSize || unpack_bounded(packed, packedSize, unpacked, DATA_SIZE, NULL) != size
+			    || memcmp(unpacked, input, size)) {
+				printf("Round trip failed for %u-byte input in %s mode!\n",
+				       (unsigned)size, modes[m].name);
+				failed = 1;
+			}
+
+			free(input);
+		}
+	}
+
+	free(packed);
+	free(unpacked);
+	return failed;
+}
+
+// Decodes a back reference to data that hasn't been written yet, which unpack_bounded()
+// has to reject and unpack() has to allow (copying whatever is already in the buffer.)
+static int check_invalid_backref (void) {
+	// 1 uncompressed byte, then a 2-byte back reference to offset 4
+	const uint8_t packed[] = {0x00, 0xAA, 0x81, 0x00, 0x04, 0xFF};
+	uint8_t *unpacked = (uint8_t*)malloc(DATA_SIZE);
+	int failed = 0;
+
+	memset(unpacked, 0x55, DATA_SIZE);
+	if (unpack_bounded(packed, sizeof(packed), unpacked, DATA_SIZE, NULL) != 0) {
+		printf("Invalid back reference was not rejected by unpack_bounded!\n");
+		failed = 1;
+	}
+
+	uint8_t input[DATA_SIZE] = {0};
+	memcpy(input, packed, sizeof(packed));
+	memset(unpacked, 0x55, DATA_SIZE);
+	if (unpack(input, unpacked) != 3 || unpacked[0] != 0xAA
+	    || unpacked[1] != 0x55 || unpacked[2] != 0x55) {
+		printf("Invalid back reference was not decoded the same way by unpack!\n");
+		failed = 1;
+	}
+
+	free(unpacked);
+	return failed;
+}
+
+static double seconds (clock_t start) {
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static double mb_per_sec (size_t bytes, double secs) {
+	return secs > 0 ? bytes / secs / (1024 * 1024) : 0;
+}
+
+int main (int argc, char **argv) {
+	const char *romPath = NULL;
+	const char *baselinePath = NULL;
+	int iterations = 3;
+	int failed = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			iterations = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+			baselinePath = argv[++i];
+		else if (argv[i][0] == '-') {
+			printf("Usage: %s [-n iterations] [-b baseline] [rom.nes]\n", argv[0]);
+			return 1;
+		} else
+			romPath = argv[i];
+	}
+	if (iterations < 1) iterations = 1;
+
+	chunk_t chunks[MAX_CHUNKS];
+	size_t numChunks, totalSize = 0;
+
+	if (romPath) {
+		numChunks = load_rom(romPath, chunks);
+		if (!numChunks) {
+			printf("Unable to load any data from %s.\n", romPath);
+			return 1;
+		}
+		printf("Loaded %u chunks from %s", (unsigned)numChunks, romPath);
+	} else {
+		numChunks = load_synthetic(chunks);
+		printf("Generated %u synthetic chunks", (unsigned)numChunks);
+	}
+	for (size_t i = 0; i < numChunks; i++)
+		totalSize += chunks[i].size;
+	printf(" (%u bytes, %d iterations, %s kernels)\n\n", (unsigned)totalSize, iterations,
+	       matchlen_kernels(MATCHLEN_BEST)->name);
+
+	// compressed data for every chunk, for the current mode
+	uint8_t *packed[MAX_CHUNKS];
+	size_t   packedSize[MAX_CHUNKS];
+	for (size_t i = 0; i < numChunks; i++)
+		packed[i] = (uint8_t*)malloc(DATA_SIZE);
+	uint8_t *unpacked = (uint8_t*)malloc(DATA_SIZE);
+
+	pack_scratch_t *scratch = pack_scratch_new();
+	uint32_t sums[NUM_MODES];
+
+	printf("Mode          Pack MB/s  Unpack MB/s  Round trip MB/s    Packed  Ratio ~Frames/room\n");
+
+	for (size_t m = 0; m < NUM_MODES; m++) {
+		unsigned long counts[7] = {0};
+		size_t totalPacked = 0;
+		double cycles = 0;
+
+		// compress everything
+		clock_t start = clock();
+		for (int it = 0; it < iterations; it++) {
+			for (size_t i = 0; i < numChunks; i++)
+				packedSize[i] = pack_with_scratch(chunks[i].data, chunks[i].size, packed[i],
+				                                  modes[m].mode, scratch);
+		}
+		double packTime = seconds(start) / iterations;
+
+		// decompress everything
+		start = clock();
+		for (int it = 0; it < iterations; it++) {
+			for (size_t i = 0; i < numChunks; i++)
+				unpack_bounded(packed[i], packedSize[i], unpacked, DATA_SIZE, NULL);
+		}
+		double unpackTime = seconds(start) / iterations;
+
+		// make sure everything decompresses correctly and see what was used
+		sums[m] = 2166136261u;
+		for (size_t i = 0; i < numChunks; i++) {
+			size_t consumed = 0;
+			size_t size = unpack_bounded(packed[i], packedSize[i], unpacked, DATA_SIZE, &consumed);
+
+			if (!packedSize[i] || size != chunks[i].size || consumed != packedSize[i]
+			    || memcmp(unpacked, chunks[i].data, size)) {
+				printf("Round trip failed for chunk %u in %s mode!\n", (unsigned)i, modes[m].name);
+				failed = 1;
+			}
+
+			totalPacked += packedSize[i];
+			cycles += unpack_cycles(packed[i], packedSize[i]);
+			count_methods(packed[i], packedSize[i], counts);
+			sums[m] = checksum(sums[m], packed[i], packedSize[i]);
+		}
+
+		printf("%-12s %10.2f %12.2f %16.2f %9u %5.1f%% %12.2f\n", modes[m].name,
+		       mb_per_sec(totalSize, packTime),
+		       mb_per_sec(totalSize, unpackTime),
+		       mb_per_sec(totalSize, packTime + unpackTime),
+		       (unsigned)totalPacked, 100.0 * totalPacked / totalSize,
+		       cycles / numChunks / NES_CYCLES_PER_FRAME);
+
+		for (int i = 0; i < 7; i++)
+			printf("    %-18s: %lu\n", methodNames[i], counts[i]);
+	}
+
+	failed |= check_short_inputs(chunks, numChunks, scratch);
+	failed |= check_invalid_backref();
+
+	// check for any changes in the compressed data
+	printf("\n");
+	if (baselinePath) {
+		FILE *file = fopen(baselinePath, "r");
+		if (file) {
+			for (size_t m = 0; m < NUM_MODES; m++) {
+				char line[64];
+				unsigned long expected;
+				if (!fgets(line, sizeof(line), file) || sscanf(line, "%lx", &expected) != 1
+				    || expected != sums[m]) {
+					printf("Compressed data changed in %s mode (checksum %08x)!\n",
+					       modes[m].name, (unsigned)sums[m]);
+					failed = 1;
+				}
+			}
+			fclose(file);
+		} else if ((file = fopen(baselinePath, "w"))) {
+			for (size_t m = 0; m < NUM_MODES; m++)
+				fprintf(file, "%08x %s\n", (unsigned)sums[m], modes[m].name);
+			fclose(file);
+			printf("Saved checksums to %s.\n", baselinePath);
+		} else {
+			printf("Unable to save checksums to %s.\n", baselinePath);
+			failed = 1;
+		}
+	} else if (!romPath) {
+		for (size_t m = 0; m < NUM_MODES; m++) {
+			if (sums[m] != modes[m].synthetic) {
+				printf("Compressed data changed in %s mode (checksum %08x)!\n",
+				       modes[m].name, (unsigned)sums[m]);
+				failed = 1;
+			}
+		}
+	}
+
+	printf(failed ? "FAILED\n" : "OK\n");
+
+	pack_scratch_free(scratch);
+	for (size_t i = 0; i < numChunks; i++) {
+		free(chunks[i].data);
+		free(packed[i]);
+	}
+	free(unpacked);
+
+	return failed;
+}
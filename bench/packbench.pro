@@ -0,0 +1,19 @@
+# standalone compression benchmark (see packbench.c for usage)
+
+QMAKE_CFLAGS += -std=c99
+
+TARGET = packbench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += ../src
+
+SOURCES += \
+    packbench.c \
+    ../src/compress.c \
+    ../src/matchlen.c
+
+HEADERS += \
+    ../src/compress.h \
+    ../src/matchlen.h
@@ -0,0 +1,126 @@
+/*
+  savecheck.cpp
+  Regression check for saving: builds a blank ROM with valid reset code, saves a full
+  set of rooms to it, then makes one room much bigger (so its packed size changes and
+  everything after it moves) and saves again. Both saves have to get past the check
+  that reads every room back from the ROM, and the second room has to load correctly
+  from the saved file afterwards.
+
+  usage: savecheck
+
+  This code is released under the terms of the MIT license.
+  See COPYING.txt for details.
+*/
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QTemporaryDir>
+#include <cstdio>
+#include <cstring>
+
+#include "savejob.h"
+#include "compress.h"
+
+// iNES header + 512kb PRG + 256kb CHR
+static const uint prgBanks = 0x20, chrBanks = 0x20;
+static const uint romSize  = 16 + (prgBanks * 0x4000) + (chrBanks * 0x2000);
+
+static bool makeROM(const QString& path) {
+    QByteArray image(romSize, 0);
+    memcpy(image.data(), "NES\x1a", 4);
+    image[4] = prgBanks;
+    image[5] = chrBanks;
+
+    // reset code checked by ROMFile::openROM at 3F:FFF0
+    const uint8_t resetCode[9] = {0x78, 0xa9, 0, 0x8d, 0, 0x80, 0x4c, 0, 0xc0};
+    memcpy(image.data() + 16 + (0x3F * BANK_SIZE) + (0xFFF0 % BANK_SIZE), resetCode, 9);
+
+    QFile file(path);
+    return file.open(QIODevice::WriteOnly) && file.write(image) == image.size();
+}
+
+static void setRoom(leveldata_t *level, uint screensH, uint screensV, uint seed) {
+    *level = leveldata_t();
+    memset(&level->header, 0, sizeof(header_t));
+    memset(&level->extra, 0, sizeof(extradata_t));
+    level->header.screensH = screensH;
+    level->header.screensV = screensV;
+    level->tileset = seed % NUM_TILESETS;
+    level->noReturn = false;
+    level->modified = false;
+
+    // noisy enough that the room can't be packed down to almost nothing
+    uint32_t rng = seed * 2654435761u + 1;
+    for (uint v = 0; v < screensV; v++) {
+        for (uint h = 0; h < screensH; h++) {
+            uint8_t tiles[SCREEN_SIZE];
+            for (uint i = 0; i < SCREEN_SIZE; i++) {
+                rng = rng * 1103515245 + 12345;
+                tiles[i] = (i % 4) ? tiles[i - 1] : (rng >> 16) & 0x7F;
+            }
+            level->tiles.setScreen(h, v, tiles);
+        }
+    }
+}
+
+static bool save(const QString& path, const saveData_t& data) {
+    SaveJob job(path, QString(), PACK_NORMAL, ChunkCache(), QString());
+    job.data = data;
+    job.run();
+
+    if (job.result != SaveJob::saved) {
+        fprintf(stderr, "save failed: %s\n", qPrintable(job.error));
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    QCoreApplication app(argc, argv);
+
+    QTemporaryDir dir;
+    const QString path = dir.path() + "/test.nes";
+    if (!dir.isValid() || !makeROM(path)) {
+        fprintf(stderr, "unable to create test ROM\n");
+        return 1;
+    }
+
+    saveData_t *data = new saveData_t;
+    data->levels.resize(NUM_LEVELS);
+    data->hasExtra = false;
+    memset(data->tilesets, 0, sizeof(data->tilesets));
+    memset(data->tileSubtract, 0, sizeof(data->tileSubtract));
+    memset(data->bankTable, 0, sizeof(data->bankTable));
+    memset(data->palettes, 0, sizeof(data->palettes));
+    memset(data->sprPalettes, 0, sizeof(data->sprPalettes));
+
+    for (uint i = 0; i < NUM_LEVELS; i++) {
+        setRoom(&data->levels[i], 1, 1, i);
+    }
+
+    // first save: all pointers in the ROM start out empty
+    int status = 0;
+    if (!save(path, *data)) {
+        status = 1;
+    } else {
+        // second save: room 0 grows, moving everything placed after it
+        const uint num = 0;
+        setRoom(&data->levels[num], 4, 2, 0x1234);
+        if (!save(path, *data))
+            status = 1;
+
+        ROMFile rom;
+        rom.setFileName(path);
+        leveldata_t *saved = rom.openROM(QIODevice::ReadOnly) ? loadLevel(rom.view(), num) : NULL;
+        if (!saved || saved->header.screensH != 4 || saved->header.screensV != 2) {
+            fprintf(stderr, "room %u was not saved correctly\n", num);
+            status = 1;
+        }
+        delete saved;
+    }
+
+    delete data;
+    if (!status)
+        printf("OK\n");
+    return status;
+}
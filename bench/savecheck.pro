@@ -0,0 +1,42 @@
+# standalone save regression check (see savecheck.cpp for usage)
+
+QT += core widgets concurrent
+
+QMAKE_CFLAGS += -std=c99
+QMAKE_CXXFLAGS += -std=c++11
+
+TARGET = savecheck
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../src
+
+SOURCES += \
+    savecheck.cpp \
+    ../src/savejob.cpp \
+    ../src/romfile.cpp \
+    ../src/level.cpp \
+    ../src/tilemap.cpp \
+    ../src/tileset.cpp \
+    ../src/graphics.cpp \
+    ../src/mapclear.cpp \
+    ../src/patches.cpp \
+    ../src/chunkcache.cpp \
+    ../src/stuff.cpp \
+    ../src/compress.c \
+    ../src/matchlen.c
+
+HEADERS += \
+    ../src/savejob.h \
+    ../src/romfile.h \
+    ../src/level.h \
+    ../src/tilemap.h \
+    ../src/tileset.h \
+    ../src/graphics.h \
+    ../src/mapclear.h \
+    ../src/patches.h \
+    ../src/chunkcache.h \
+    ../src/stuff.h \
+    ../src/compress.h \
+    ../src/matchlen.h
@@ -1,4 +1,4 @@
-QT       += core widgets
+QT       += core widgets concurrent
 
 QMAKE_CFLAGS += -std=c99
 QMAKE_CXXFLAGS += -std=c++11
@@ -43,6 +43,7 @@ SOURCES += \
     src/mainwindow.cpp \
     src/level.cpp \
     src/compress.c \
+    src/matchlen.c \
     src/main.cpp \
     src/tileset.cpp \
     src/coursewindow.cpp \
@@ -59,7 +60,11 @@ SOURCES += \
     src/mapcleareditwindow.cpp \
     src/tileseteditwindow.cpp \
     src/paletteeditwindow.cpp \
-    src/patches.cpp
+    src/patches.cpp \
+    src/chunkcache.cpp \
+    src/projectcache.cpp \
+    src/tilemap.cpp \
+    src/savejob.cpp
 
 HEADERS  += \
     src/romfile.h \
@@ -68,6 +73,7 @@ HEADERS  += \
     src/mainwindow.h \
     src/level.h \
     src/compress.h \
+    src/matchlen.h \
     src/version.h \
     src/graphics.h \
     src/tileset.h \
@@ -84,7 +90,11 @@ HEADERS  += \
     src/mapcleareditwindow.h \
     src/tileseteditwindow.h \
     src/paletteeditwindow.h \
-    src/patches.h
+    src/patches.h \
+    src/chunkcache.h \
+    src/projectcache.h \
+    src/tilemap.h \
+    src/savejob.h
 
 FORMS += \
     src/mainwindow.ui \
@@ -0,0 +1,136 @@
+/*
+  chunkcache.cpp
+  Cache of compressed data chunks, used to avoid compressing the same level maps and
+  tilesets over and over again when saving.
+
+  The cache can also be saved to/loaded from a file so it persists between sessions.
+
+  This code is released under the terms of the MIT license.
+  See COPYING.txt for details.
+*/
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+#include <QSaveFile>
+
+#include "chunkcache.h"
+
+#define CACHE_MAGIC   0x4B504348 // "KPCH"
+#define CACHE_VERSION 1
+
+/*
+  Returns the cache key for an uncompressed data chunk.
+*/
+QByteArray ChunkCache::key(const DataChunk &chunk, int mode) {
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    const char modeByte = mode;
+
+    hash.addData(&modeByte, 1);
+    hash.addData((const char*)chunk.data.data(), chunk.size);
+
+    return hash.result();
+}
+
+/*
+  Replaces the contents of an uncompressed data chunk with the cached compressed data.
+  Returns false (and leaves the chunk alone) if nothing is cached for this key.
+*/
+bool ChunkCache::get(const QByteArray &key, DataChunk &chunk) {
+    QHash<QByteArray, QByteArray>::const_iterator i = packed.constFind(key);
+    if (i == packed.constEnd())
+        return false;
+
+    chunk.data.assign(i->constData(), i->constData() + i->size());
+    chunk.size = i->size();
+    used.insert(key);
+
+    return true;
+}
+
+/*
+  Adds a newly compressed data chunk to the cache.
+*/
+void ChunkCache::put(const QByteArray &key, const DataChunk &chunk) {
+    packed.insert(key, QByteArray((const char*)chunk.data.data(), chunk.size));
+    used.insert(key);
+}
+
+/*
+  Removes everything that hasn't been used since the last time this was called
+  (i.e. data for rooms/tilesets that have been changed since the last save.)
+*/
+void ChunkCache::prune() {
+    QHash<QByteArray, QByteArray>::iterator i = packed.begin();
+    while (i != packed.end()) {
+        if (used.contains(i.key()))
+            i++;
+        else
+            i = packed.erase(i);
+    }
+
+    used.clear();
+}
+
+void ChunkCache::clear() {
+    packed.clear();
+    used.clear();
+}
+
+/*
+  Adds everything from another cache to this one
+  (i.e. when a copy of the cache has been used somewhere else in the meantime.)
+*/
+void ChunkCache::merge(const ChunkCache &other) {
+    for (QHash<QByteArray, QByteArray>::const_iterator i = other.packed.constBegin();
+         i != other.packed.constEnd(); i++) {
+        packed.insert(i.key(), i.value());
+    }
+    used.unite(other.used);
+}
+
+/*
+  Loads cached data from a file, replacing the current contents of the cache.
+  Returns false if the file doesn't exist or isn't a valid cache file.
+*/
+bool ChunkCache::load(const QString &path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    quint32 magic, version;
+    stream >> magic >> version;
+    if (magic != CACHE_MAGIC || version != CACHE_VERSION)
+        return false;
+
+    QHash<QByteArray, QByteArray> newPacked;
+    stream >> newPacked;
+    if (stream.status() != QDataStream::Ok)
+        return false;
+
+    packed = newPacked;
+    used.clear();
+    return true;
+}
+
+/*
+  Saves the current contents of the cache to a file.
+  (The file is only replaced once everything has been written.)
+*/
+bool ChunkCache::save(const QString &path) const {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    QDataStream stream(&file);
+    stream << (quint32)CACHE_MAGIC << (quint32)CACHE_VERSION;
+    stream << packed;
+
+    if (stream.status() != QDataStream::Ok) {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
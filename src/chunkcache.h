@@ -0,0 +1,38 @@
+/*
+    This code is released under the terms of the MIT license.
+    See COPYING.txt for details.
+*/
+
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include "romfile.h"
+
+/*
+  Keeps compressed level/tileset data keyed by a hash of the uncompressed data
+  (and compression mode), so unchanged data doesn't get compressed again on every save.
+*/
+class ChunkCache {
+public:
+    static QByteArray key(const DataChunk &chunk, int mode);
+
+    bool get(const QByteArray &key, DataChunk &chunk);
+    void put(const QByteArray &key, const DataChunk &chunk);
+    void prune();
+    void clear();
+    void merge(const ChunkCache &other);
+
+    bool load(const QString &path);
+    bool save(const QString &path) const;
+
+private:
+    QHash<QByteArray, QByteArray> packed;
+    // keys used since the last call to prune()
+    QSet<QByteArray> used;
+};
+
+#endif // CHUNKCACHE_H
@@ -27,9 +27,10 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "compress.h"
-#include "uthash.h"
+#include "matchlen.h"
 
 #ifdef DEBUG_OUT
 #define debug(...) printf(__VA_ARGS__)
@@ -61,29 +62,227 @@ typedef struct {
 } rle_t;
 
 // used to hash and index byte tuples
+// (each distinct tuple points to its first and last occurrences in the input;
+//  all other occurrences are linked together in the matcher's chain array)
 typedef struct {
-	int      bytes;
-	uint16_t offset;
-	UT_hash_handle hh;
+	uint32_t bytes;
+	uint32_t gen;
+	uint16_t first, last;
 } tuple_t;
 // turn 4 bytes into a single integer for quicker hashing/searching
-#define COMBINE(w, x, y, z) ((w << 24) | (x << 16) | (y << 8) | z)
+#define COMBINE(w, x, y, z) (((uint32_t)w << 24) | (x << 16) | (y << 8) | z)
+
+// size of the open-addressed tuple table
+// (at least twice the maximum number of distinct tuples in the input)
+#define TUPLE_BITS 17
+#define TUPLE_SIZE (1 << TUPLE_BITS)
+
+// marks the end of a chain of tuple occurrences
+#define NO_OFFSET 0xFFFF
+// maximum number of earlier occurrences to check per search in fast/optimal mode
+// (normal mode always checks every occurrence. optimal mode searches at every position,
+//  so its limit mostly bounds the worst case; anything deeper didn't find better matches)
+#define FAST_CHAIN_DEPTH    256
+#define OPTIMAL_CHAIN_DEPTH 256
+// in optimal mode, stop searching once a back reference at least this long is found
+// (and don't search again until the end of it)
+#define OPTIMAL_NICE_SIZE   128
+
+// rough estimates of the number of CPU cycles used by the game's decompression routine
+// to read and start each command (more for long commands and back references).
+// these weren't counted from the routine itself, so they're only good for comparing
+// how costly different data is to decompress, not for exact timings
+#define CYCLES_COMMAND      42
+#define CYCLES_LONG_COMMAND 14
+#define CYCLES_BACKREF      22
+// rough estimate of CPU cycles used per byte of output, indexed by command number
+// (bit rotation is done one bit at a time, so it's a lot slower than everything else)
+static const uint8_t cycles_per_byte[8] = {
+	27, // uncompressed
+	17, // 8-bit RLE
+	19, // 16-bit RLE
+	21, // sequence RLE
+	33, // backref
+	61, // backref with bit rotation
+	35, // backwards backref
+	33  // (same as 4)
+};
+
+// in decode speed mode, each byte of compressed data is worth this many CPU cycles
+#define DECODE_BYTE_WEIGHT  128
+
+// relative cost of compressed size vs. decompression time used by pack_optimal()
+typedef struct {
+	uint32_t bytes, cycles;
+} weights_t;
+
+// everything pack() needs to work with, allocated all at once.
+// tuple table entries are only valid if their generation matches the current one,
+// so the table never has to be cleared between uses
+struct pack_scratch_s {
+	tuple_t  tuples[TUPLE_SIZE];
+	uint32_t gen;
+	uint16_t next[DATA_SIZE];
+	
+	// used by pack_optimal()
+	uint32_t  cost[DATA_SIZE + 1];
+	uint16_t  length[DATA_SIZE + 1];
+	uint8_t   type[DATA_SIZE + 1];
+	backref_t refs[DATA_SIZE + 1];
+	uint32_t  window[DATA_SIZE + 1];
+	uint8_t   temp[DATA_SIZE];
+};
+
+// hash chain match finder used by all back reference search methods
+typedef struct {
+	pack_scratch_t *scratch;
+	const matchlen_t *match;
+	uint32_t maxchain, nicesize;
+} matcher_t;
 
 uint8_t    rotate (uint8_t);
-rle_t      rle_check (uint8_t*, uint8_t*, uint32_t, int);
-backref_t  ref_search (uint8_t*, uint8_t*, uint32_t, tuple_t*, int);
+rle_t      rle_check (uint8_t*, uint8_t*, uint32_t, const matchlen_t*, int);
+backref_t  ref_search (uint8_t*, uint8_t*, uint32_t, matcher_t*, int);
+void       chain_search (uint8_t*, uint8_t*, uint32_t, matcher_t*, uint32_t, method_e, backref_t*);
 uint16_t   write_backref (uint8_t*, uint16_t, backref_t);
 uint16_t   write_rle (uint8_t*, uint16_t, rle_t);
 uint16_t   write_raw (uint8_t*, uint16_t, uint8_t*, uint16_t);
-void       free_offsets(tuple_t*);
+uint16_t   backref_cost (uint16_t);
+uint16_t   rle_cost (rle_t);
+uint16_t   raw_cost (uint16_t);
+uint32_t   command_cycles (uint8_t, uint16_t);
+size_t     pack_greedy (uint8_t*, size_t, uint8_t*, matcher_t*, int);
+size_t     pack_optimal (uint8_t*, size_t, uint8_t*, matcher_t*, const weights_t*);
+size_t     unpack_checked (const uint8_t*, size_t, uint8_t*, size_t, size_t*, int);
+tuple_t*   tuple_find (pack_scratch_t*, uint32_t, int);
 
 // Compresses a file of up to 64 kb.
 // unpacked/packed are 65536 byte buffers to read/from write to, 
 // inputsize is the length of the uncompressed data.
+// mode is one of PACK_NORMAL, PACK_FAST, PACK_OPTIMAL or PACK_FAST_DECODE.
 // Returns the size of the compressed data in bytes, or 0 if compression failed.
-size_t pack(uint8_t *unpacked, size_t inputsize, uint8_t *packed, int fast) {
+// This allocates (and frees) a new work area every time it's called, so anything
+// compressing more than one file should use pack_with_scratch() instead.
+size_t pack(uint8_t *unpacked, size_t inputsize, uint8_t *packed, int mode) {
+	pack_scratch_t *scratch = pack_scratch_new();
+	if (!scratch) return 0;
+	
+	size_t outsize = pack_with_scratch(unpacked, inputsize, packed, mode, scratch);
+	
+	pack_scratch_free(scratch);
+	return outsize;
+}
+
+// Allocates a work area for pack_with_scratch().
+// Returns NULL if allocation failed.
+// (calloc instead of malloc + memset, since a block this size comes straight from
+//  the OS already zeroed, and only the parts that actually get used are touched)
+pack_scratch_t* pack_scratch_new (void) {
+	return (pack_scratch_t*)calloc(1, sizeof(pack_scratch_t));
+}
+
+void pack_scratch_free (pack_scratch_t *scratch) {
+	free(scratch);
+}
+
+// Same as pack(), but uses an existing work area instead of allocating one.
+// A work area can be reused any number of times, but only by one thread at a time.
+size_t pack_with_scratch(uint8_t *unpacked, size_t inputsize, uint8_t *packed, int mode,
+                         pack_scratch_t *scratch) {
 	if (inputsize > DATA_SIZE) return 0;
+	
+	int fast = (mode == PACK_FAST);
+	size_t outsize;
+	
+	// index of byte-tuple locations used to speed up LZ string search
+	matcher_t matcher;
+	matcher.scratch  = scratch;
+	matcher.match    = matchlen_kernels(MATCHLEN_BEST);
+	matcher.maxchain = fast ? FAST_CHAIN_DEPTH : 0;
+	matcher.nicesize = 0;
+	
+	// invalidate the previous contents of the tuple table
+	// (it only needs to really be cleared once every 4 billion uses)
+	if (++scratch->gen == 0) {
+		memset(scratch->tuples, 0, sizeof(scratch->tuples));
+		scratch->gen = 1;
+	}
+	
+	debug("inputsize = %d\n", inputsize);
+	
+	for (uint16_t i = 0; inputsize >= 4 && i < inputsize - 4; i++) {
+		uint32_t currbytes = COMBINE(unpacked[i], unpacked[i+1], unpacked[i+2], unpacked[i+3]);
+		
+		// has this one been indexed already
+		tuple_t *tuple = tuple_find(scratch, currbytes, 1);
+		if (tuple->gen != scratch->gen) {
+			tuple->gen   = scratch->gen;
+			tuple->first = i;
+		} else {
+			// link the previous occurrence to this one
+			scratch->next[tuple->last] = i;
+		}
+		tuple->last = i;
+		scratch->next[i] = NO_OFFSET;
+	}
+	
+	outsize = pack_greedy(unpacked, inputsize, packed, &matcher, fast);
+	
+	// optimal mode: also try an optimal parse and keep it if it's any smaller
+	// (it skips searching inside of long back references to keep the time bounded,
+	//  so in rare cases the greedy parse can still come out ahead)
+	// fast decode mode does the same thing, but counts decompression time as well as size
+	if ((mode == PACK_OPTIMAL || mode == PACK_FAST_DECODE) && outsize) {
+		weights_t weights = { 1, 0 };
+		if (mode == PACK_FAST_DECODE) {
+			weights.bytes  = DECODE_BYTE_WEIGHT;
+			weights.cycles = 1;
+		}
+		
+		matcher.maxchain = OPTIMAL_CHAIN_DEPTH;
+		matcher.nicesize = OPTIMAL_NICE_SIZE;
+		
+		size_t tempsize = pack_optimal(unpacked, inputsize, scratch->temp, &matcher, &weights);
+		if (tempsize) {
+			uint64_t oldcost = (uint64_t)outsize * weights.bytes;
+			uint64_t newcost = (uint64_t)tempsize * weights.bytes;
+			if (weights.cycles) {
+				oldcost += (uint64_t)unpack_cycles(packed, outsize) * weights.cycles;
+				newcost += (uint64_t)unpack_cycles(scratch->temp, tempsize) * weights.cycles;
+			}
+			
+			if (newcost < oldcost) {
+				memcpy(packed, scratch->temp, tempsize);
+				outsize = tempsize;
+			}
+		}
+	}
+	
+	return outsize;
+}
 
+// Finds the tuple table entry for a sequence of 4 bytes.
+// If add is nonzero, returns an unused entry (with an old generation number) if the
+// tuple isn't in the table yet, otherwise returns NULL in that case.
+tuple_t* tuple_find (pack_scratch_t *scratch, uint32_t bytes, int add) {
+	uint32_t i = (bytes * 2654435761u) >> (32 - TUPLE_BITS);
+	
+	while (scratch->tuples[i].gen == scratch->gen) {
+		if (scratch->tuples[i].bytes == bytes)
+			return &scratch->tuples[i];
+		i = (i + 1) & (TUPLE_SIZE - 1);
+	}
+	
+	if (!add) return NULL;
+	
+	scratch->tuples[i].bytes = bytes;
+	return &scratch->tuples[i];
+}
+
+// Compresses a file by always using the longest RLE or back reference available.
+// The input has already been indexed by pack().
+// Returns the size of the compressed data in bytes, or 0 if compression failed.
+size_t pack_greedy(uint8_t *unpacked, size_t inputsize, uint8_t *packed, matcher_t *matcher, int fast) {
 	// current input/output positions
 	uint32_t  inpos = 0;
 	uint32_t  outpos = 0;
@@ -95,40 +294,19 @@ size_t pack(uint8_t *unpacked, size_t inputsize, uint8_t *packed, int fast) {
 	// used to collect data which should be written uncompressed
 	uint8_t  dontpack[LONG_RUN_SIZE];
 	uint16_t dontpacksize = 0;
-
-	// index of first locations of byte-tuples used to speed up LZ string search
-	tuple_t *offsets = NULL;
-	
-	debug("inputsize = %d\n", inputsize);
-	
-	for (uint16_t i = 0; inputsize >= 4 && i < inputsize - 4; i++) {
-		tuple_t *tuple;
-		int currbytes = COMBINE(unpacked[i], unpacked[i+1], unpacked[i+2], unpacked[i+3]);
-		
-		// has this one been indexed already
-		HASH_FIND_INT(offsets, &currbytes, tuple);
-		if (!tuple) {
-			tuple = (tuple_t*)malloc(sizeof(tuple_t));
-			tuple->bytes = currbytes;
-			tuple->offset = i;
-			HASH_ADD_INT(offsets, bytes, tuple);
-		}
-	}
 	
 	while (inpos < inputsize) {
 		// check for a potential RLE
-		rle = rle_check(unpacked, unpacked + inpos, inputsize, fast);
+		rle = rle_check(unpacked, unpacked + inpos, inputsize, matcher->match, fast);
 		// check for a potential back reference
 		if (rle.size < LONG_RUN_SIZE && inputsize >= 3 && inpos < inputsize - 3)
-			backref = ref_search(unpacked, unpacked + inpos, inputsize, offsets, fast);
+			backref = ref_search(unpacked, unpacked + inpos, inputsize, matcher, fast);
 		else backref.size = 0;
 		
 		// if the backref is a better candidate, use it
 		if (backref.size > 3 && backref.size > rle.size) {
-			if (outpos + dontpacksize + backref.size >= DATA_SIZE) {
-				free_offsets(offsets);
+			if (outpos + dontpacksize + backref.size >= DATA_SIZE)
 				return 0;
-			}
 		
 			// flush the raw data buffer first
 			outpos += write_raw(packed, outpos, dontpack, dontpacksize);
@@ -139,10 +317,8 @@ size_t pack(uint8_t *unpacked, size_t inputsize, uint8_t *packed, int fast) {
 		}
 		// or if the RLE is a better candidate, use it instead
 		else if (rle.size >= 2) {
-			if (outpos + dontpacksize + rle.size >= DATA_SIZE) {
-				free_offsets(offsets);
+			if (outpos + dontpacksize + rle.size >= DATA_SIZE)
 				return 0;
-			}
 		
 			// flush the raw data buffer first
 			outpos += write_raw(packed, outpos, dontpack, dontpacksize);
@@ -156,10 +332,8 @@ size_t pack(uint8_t *unpacked, size_t inputsize, uint8_t *packed, int fast) {
 		else {
 			dontpack[dontpacksize++] = unpacked[inpos++];
 			
-			if (outpos + dontpacksize >= DATA_SIZE) {
-				free_offsets(offsets);
+			if (outpos + dontpacksize >= DATA_SIZE)
 				return 0;
-			}
 			
 			// if the raw data buffer is full, flush it
 			if (dontpacksize == LONG_RUN_SIZE) {
@@ -170,42 +344,209 @@ size_t pack(uint8_t *unpacked, size_t inputsize, uint8_t *packed, int fast) {
 	}
 	
 	// flush any remaining uncompressed data
-	if (outpos + dontpacksize + 1 > DATA_SIZE) {
-		free_offsets(offsets);
+	if (outpos + dontpacksize + 1 > DATA_SIZE)
 		return 0;
-	}
 	
 	outpos += write_raw(packed, outpos, dontpack, dontpacksize);
 	
 	//add the terminating byte
 	packed[outpos++] = 0xFF;
 	
-	free_offsets(offsets);
 	return (size_t)outpos;
 }
 
-void free_offsets(tuple_t *offsets) {
-	tuple_t *curr, *temp;
-	HASH_ITER(hh, offsets, curr, temp) {
-		HASH_DEL(offsets, curr);
-		free(curr);
+// Compresses a file using the smallest possible combination of commands
+// instead of always taking the longest one available at each position.
+// "Smallest" is based on both the compressed size and the estimated decompression time
+// of each command, weighted by the values in weights.
+// The input has already been indexed by pack().
+// Returns the size of the compressed data in bytes, or 0 if compression failed.
+size_t pack_optimal(uint8_t *unpacked, size_t inputsize, uint8_t *packed, matcher_t *matcher,
+                    const weights_t *weights) {
+	// command types used to reach each position
+	enum { cmd_raw, cmd_rle, cmd_backref };
+	
+	// cost of a command based on its size and decompression time
+	#define WEIGHT(numbytes, command, size) \
+		((numbytes) * weights->bytes + (weights->cycles ? command_cycles(command, size) * weights->cycles : 0))
+	// cost of each additional uncompressed byte in a long run
+	const int64_t rawweight = weights->bytes + cycles_per_byte[0] * weights->cycles;
+
+	// smallest total cost of the input up to each position,
+	// plus the size and type of the last command used to get there
+	uint32_t *cost   = matcher->scratch->cost;
+	uint16_t *length = matcher->scratch->length;
+	uint8_t  *type   = matcher->scratch->type;
+	// best back reference starting at each position
+	backref_t *refs  = matcher->scratch->refs;
+	// sliding window of positions to start long uncompressed runs from
+	// (also reused to store the final list of commands)
+	uint32_t *window = matcher->scratch->window;
+	uint32_t  head = 0, tail = 0;
+	
+	uint32_t outpos = 0;
+	
+	backref_t backref = { 0, 0, 0 };
+	
+	cost[0] = 0;
+	for (uint32_t i = 1; i <= inputsize; i++)
+		cost[i] = UINT32_MAX;
+	
+	for (uint32_t i = 0; i <= inputsize; i++) {
+		// every earlier position up to LONG_RUN_SIZE bytes back can reach this one
+		// with uncompressed data. short runs have a smaller command size,
+		// so check those one at a time and keep the long ones in a sliding window
+		// ordered by (cost - cost of each byte * position)
+		for (uint32_t j = (i > RUN_SIZE) ? i - RUN_SIZE : 0; j < i; j++) {
+			uint32_t newcost = cost[j] + WEIGHT(raw_cost(i - j), 0, i - j);
+			if (newcost < cost[i]) {
+				cost[i]   = newcost;
+				length[i] = i - j;
+				type[i]   = cmd_raw;
+			}
+		}
+		if (i > RUN_SIZE) {
+			uint32_t j = i - RUN_SIZE - 1;
+			while (tail > head && (int64_t)cost[window[tail - 1]] - rawweight * window[tail - 1]
+			                   >= (int64_t)cost[j] - rawweight * j)
+				tail--;
+			window[tail++] = j;
+		}
+		while (tail > head && window[head] + LONG_RUN_SIZE < i)
+			head++;
+		if (tail > head) {
+			uint32_t j = window[head];
+			uint32_t newcost = cost[j] + WEIGHT(raw_cost(i - j), 0, i - j);
+			if (newcost < cost[i]) {
+				cost[i]   = newcost;
+				length[i] = i - j;
+				type[i]   = cmd_raw;
+			}
+		}
+		
+		if (i == inputsize) break;
+		
+		// any shorter part of the best RLE or back reference from here is also usable
+		// at the same position, so try all of those too
+		rle_t rle = rle_check(unpacked, unpacked + i, inputsize, matcher->match, 0);
+		for (uint16_t size = 2; size <= rle.size; size++) {
+			if (rle.method == rle_16 && size % 2) continue;
+			
+			rle_t part = rle;
+			part.size = size;
+			uint32_t newcost = cost[i] + WEIGHT(rle_cost(part), 1 + rle.method, size);
+			if (newcost < cost[i + size]) {
+				cost[i + size]   = newcost;
+				length[i + size] = size;
+				type[i + size]   = cmd_rle;
+			}
+		}
+		
+		if (inputsize >= 3 && i < inputsize - 3) {
+			// inside of a long back reference, just keep using the rest of it
+			if (backref.size > matcher->nicesize) {
+				backref.size--;
+				if (backref.method == lz_rev)
+					backref.offset--;
+				else
+					backref.offset++;
+			} else {
+				backref = ref_search(unpacked, unpacked + i, inputsize, matcher, 0);
+			}
+			refs[i] = backref;
+			
+			for (uint16_t size = 4; size <= backref.size; size++) {
+				uint32_t newcost = cost[i] + WEIGHT(backref_cost(size), 4 + backref.method, size);
+				if (newcost < cost[i + size]) {
+					cost[i + size]   = newcost;
+					length[i + size] = size;
+					type[i + size]   = cmd_backref;
+				}
+			}
+		}
+	}
+	
+	#undef WEIGHT
+	
+	// trace the best path backwards to get the start of each command in order
+	tail = 0;
+	for (uint32_t i = inputsize; i > 0; i -= length[i])
+		window[tail++] = i;
+	
+	uint32_t inpos = 0;
+	while (tail) {
+		uint32_t next = window[--tail];
+		uint16_t size = next - inpos;
+		
+		// compressed data plus the terminating byte has to fit in the output buffer
+		if (outpos + (type[next] == cmd_raw ? raw_cost(size) : 4) + 1 > DATA_SIZE)
+			return 0;
+		
+		if (type[next] == cmd_rle) {
+			// (re-check for the same RLE candidate found before)
+			rle_t rle = rle_check(unpacked, unpacked + inpos, inputsize, matcher->match, 0);
+			rle.size = size;
+			outpos += write_rle(packed, outpos, rle);
+		} else if (type[next] == cmd_backref) {
+			backref = refs[inpos];
+			backref.size = size;
+			outpos += write_backref(packed, outpos, backref);
+		} else {
+			outpos += write_raw(packed, outpos, unpacked + inpos, size);
+		}
+		
+		inpos = next;
 	}
+	
+	//add the terminating byte
+	packed[outpos++] = 0xFF;
+	
+	return (size_t)outpos;
 }
 
 // Decompresses a file of up to 64 kb.
 // unpacked/packed are 65536 byte buffers to read/from write to, 
 // Returns the size of the uncompressed data in bytes or 0 if decompression failed.
+// Like the game itself, back references to data that hasn't been written yet are
+// allowed and just copy whatever is already in the output buffer (they only have to
+// stay inside it.) Use unpack_bounded() to reject them instead.
 size_t unpack(uint8_t *packed, uint8_t *unpacked) {
+	return unpack_checked(packed, DATA_SIZE, unpacked, DATA_SIZE, NULL, 0);
+}
+
+// Decompresses a file without reading or writing past the end of either buffer.
+// packedsize is the amount of compressed data available and outsize is the size of the
+// output buffer. If consumed is not NULL, the amount of compressed data actually used
+// (including the terminating byte) is stored there.
+// Returns the size of the uncompressed data in bytes or 0 if decompression failed
+// (including if the data is truncated or refers to data that hasn't been written yet.)
+size_t unpack_bounded(const uint8_t *packed, size_t packedsize, uint8_t *unpacked, size_t outsize,
+                      size_t *consumed) {
+	return unpack_checked(packed, packedsize, unpacked, outsize, consumed, 1);
+}
+
+// Does the actual work for unpack() and unpack_bounded().
+// If strict is set, back references must only refer to data that has already been
+// written; otherwise they only have to stay inside the output buffer.
+size_t unpack_checked(const uint8_t *packed, size_t packedsize, uint8_t *unpacked, size_t outsize,
+                      size_t *consumed, int strict) {
 	// current input/output positions
-	uint32_t  inpos = 0;
-	uint32_t  outpos = 0;
+	size_t inpos = 0;
+	size_t outpos = 0;
 
 	uint8_t  input;
 	uint16_t command, length, offset;
 	int      methoduse[7] = {0};
 	
+	// amount of data that still needs to be readable for the current command
+	#define NEED_INPUT(n) if (inpos + (n) > packedsize) return 0
+	// back reference which starts at data not written yet (if strict) or whose end is
+	// outside of the output buffer (if not)
+	#define BAD_OFFSET(o) (strict ? (o) >= outpos : (size_t)(o) + length > outsize)
+	
 	while (1) {
 		// read command byte from input
+		NEED_INPUT(1);
 		input = packed[inpos++];
 		
 		// command 0xff = end of data
@@ -214,6 +555,7 @@ size_t unpack(uint8_t *packed, uint8_t *unpacked) {
 		
 		// check if it is a long or regular command, get the command no. and size
 		if ((input & 0xE0) == 0xE0) {
+			NEED_INPUT(1);
 			command = (input >> 2) & 0x07;
 			// get LSB of length from next byte
 			length = (((input & 0x03) << 8) | packed[inpos++]) + 1;
@@ -222,17 +564,16 @@ size_t unpack(uint8_t *packed, uint8_t *unpacked) {
 			length = (input & 0x1F) + 1;
 		}
 		
-		// don't try to decompress > 64kb
-		if (((command == 2) && (outpos + 2*length > DATA_SIZE))
-			 || (outpos + length > DATA_SIZE)) {
+		// don't try to decompress past the end of the output
+		if (((command == 2) && (outpos + 2*length > outsize))
+			 || (outpos + length > outsize)) {
 			return 0;
 		}
 		
 		switch (command) {
 		// write uncompressed bytes
-		// (note: i had to go back to using loops for all of these because memcpy/memmove
-		//  were both fucking up and handling these inconsistently between versions of gcc)
 		case 0:
+			NEED_INPUT(length);
 			memcpy(&unpacked[outpos], &packed[inpos], length);
 			
 			outpos += length;
@@ -241,14 +582,16 @@ size_t unpack(uint8_t *packed, uint8_t *unpacked) {
 		
 		// 8-bit RLE
 		case 1:
-			for (int i = 0; i < length; i++)
-				unpacked[outpos++] = packed[inpos];
-
+			NEED_INPUT(1);
+			memset(&unpacked[outpos], packed[inpos], length);
+			
+			outpos += length;
 			inpos++;
 			break;
 
 		// 16-bit RLE
 		case 2:
+			NEED_INPUT(2);
 			for (int i = 0; i < length; i++) {
 				unpacked[outpos++] = packed[inpos];
 				unpacked[outpos++] = packed[inpos+1];
@@ -259,6 +602,7 @@ size_t unpack(uint8_t *packed, uint8_t *unpacked) {
 
 		// 8-bit increasing sequence
 		case 3:
+			NEED_INPUT(1);
 			for (int i = 0; i < length; i++)
 				unpacked[outpos++] = packed[inpos] + i;
 
@@ -273,10 +617,20 @@ size_t unpack(uint8_t *packed, uint8_t *unpacked) {
 			// the original decompression routine is programmed. (one of Parasyte's docs confirms
 			// this for GB games as well). let's handle it anyway
 			command = 4;
-
+			
+			NEED_INPUT(2);
 			offset = (packed[inpos] << 8) | packed[inpos+1];
-			for (int i = 0; i < length; i++)
-				unpacked[outpos++] = unpacked[offset + i];
+			if (BAD_OFFSET(offset)) return 0;
+			
+			// if the reference overlaps the data being written, it has to be copied one
+			// byte at a time to repeat the data the same way the game does
+			if (offset + length <= outpos) {
+				memcpy(&unpacked[outpos], &unpacked[offset], length);
+				outpos += length;
+			} else {
+				for (int i = 0; i < length; i++)
+					unpacked[outpos++] = unpacked[offset + i];
+			}
 
 			inpos += 2;
 			break;
@@ -284,7 +638,10 @@ size_t unpack(uint8_t *packed, uint8_t *unpacked) {
 		// backref with bit rotation
 		// (offset is big-endian)
 		case 5:
+			NEED_INPUT(2);
 			offset = (packed[inpos] << 8) | packed[inpos+1];
+			if (BAD_OFFSET(offset)) return 0;
+			
 			for (int i = 0; i < length; i++)
 				unpacked[outpos++] = rotate(unpacked[offset + i]);
 
@@ -294,7 +651,10 @@ size_t unpack(uint8_t *packed, uint8_t *unpacked) {
 		// backwards backref
 		// (offset is big-endian)
 		case 6:
+			NEED_INPUT(2);
 			offset = (packed[inpos] << 8) | packed[inpos+1];
+			if ((strict ? offset >= outpos : offset >= outsize) || offset + 1 < length) return 0;
+			
 			for (int i = 0; i < length; i++)
 				unpacked[outpos++] = unpacked[offset - i];
 
@@ -304,6 +664,9 @@ size_t unpack(uint8_t *packed, uint8_t *unpacked) {
 		// keep track of how many times each compression method is used
 		methoduse[command]++;
 	}
+	
+	#undef NEED_INPUT
+	#undef BAD_OFFSET
 
 #ifdef EXTRA_OUT
 	printf("Method             Uses\n");
@@ -315,10 +678,61 @@ size_t unpack(uint8_t *packed, uint8_t *unpacked) {
 	printf("Backref (rotate) : %i\n", methoduse[5]);
 	printf("Backref (reverse): %i\n", methoduse[6]);
 	
-	printf("\nCompressed size:   %u bytes\n", inpos);
+	printf("\nCompressed size:   %zu bytes\n", inpos);
+#else
+	(void)methoduse;
 #endif
 
-	return (size_t)outpos;
+	if (consumed) *consumed = inpos;
+	return outpos;
+}
+
+// Roughly estimates how many CPU cycles the game will take to decompress a file
+// (see CYCLES_COMMAND above; this is an approximate cost, not an exact timing.)
+// packedsize is the amount of compressed data available.
+// Returns the estimated number of cycles, or 0 if the data is invalid.
+uint32_t unpack_cycles(const uint8_t *packed, size_t packedsize) {
+	size_t   inpos = 0;
+	uint32_t cycles = CYCLES_COMMAND;
+	
+	while (inpos < packedsize) {
+		uint8_t  input = packed[inpos++];
+		uint16_t command, length;
+		
+		// command 0xff = end of data
+		if (input == 0xFF)
+			return cycles;
+		
+		if ((input & 0xE0) == 0xE0) {
+			if (inpos >= packedsize) break;
+			command = (input >> 2) & 0x07;
+			length = (((input & 0x03) << 8) | packed[inpos++]) + 1;
+		} else {
+			command = input >> 5;
+			length = (input & 0x1F) + 1;
+		}
+		
+		// get the number of output bytes and skip over the rest of this command
+		switch (command) {
+		case 0:
+			inpos += length;
+			break;
+		case 2:
+			length *= 2;
+			inpos += 2;
+			break;
+		case 1:
+		case 3:
+			inpos++;
+			break;
+		default:
+			inpos += 2;
+		}
+		
+		cycles += command_cycles(command, length);
+	}
+	
+	return 0;
 }
 
 // Decompress data from an offset into a file
@@ -326,9 +740,9 @@ size_t unpack_from_file (FILE *file, size_t offset, uint8_t *unpacked) {
 	uint8_t packed[DATA_SIZE];
 	
 	fseek(file, offset, SEEK_SET);
-	fread((void*)packed, DATA_SIZE, 1, file);
+	size_t packedsize = fread((void*)packed, 1, DATA_SIZE, file);
 	if (!ferror(file))
-		return unpack(packed, unpacked);
+		return unpack_bounded(packed, packedsize, unpacked, DATA_SIZE, NULL);
 		
 	return 0;
 }
@@ -336,33 +750,37 @@ size_t unpack_from_file (FILE *file, size_t offset, uint8_t *unpacked) {
 // Reverses the order of bits in a byte.
 // One of the back reference methods does this. As far as game data goes, it seems to be
 // pretty useful for compressing graphics.
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4 ), R4(n + 1*4 ), R4(n + 3*4 )
+static const uint8_t rotate_table[256] = {
+	R6(0), R6(2), R6(1), R6(3)
+};
+#undef R2
+#undef R4
+#undef R6
+
 uint8_t rotate (uint8_t i) {
-	uint8_t j = 0;
-	if (i & 0x01) j |= 0x80;
-	if (i & 0x02) j |= 0x40;
-	if (i & 0x04) j |= 0x20;
-	if (i & 0x08) j |= 0x10;
-	if (i & 0x10) j |= 0x08;
-	if (i & 0x20) j |= 0x04;
-	if (i & 0x40) j |= 0x02;
-	if (i & 0x80) j |= 0x01;
-	
-	return j;
+	return rotate_table[i];
 }
 
 // Searches for possible RLE compressed data.
 // start and current are positions within the uncompressed input stream.
+// match is the set of kernels used to find the length of each run.
 // fast enables faster compression by ignoring sequence RLE.
-rle_t rle_check (uint8_t *start, uint8_t *current, uint32_t insize, int fast) {
+rle_t rle_check (uint8_t *start, uint8_t *current, uint32_t insize, const matchlen_t *match, int fast) {
 	rle_t candidate = { 0, 0, 0 };
-	size_t size;
+	uint32_t size;
+	uint32_t maxsize = start + insize - current;
+	
+	if (maxsize > LONG_RUN_SIZE) maxsize = LONG_RUN_SIZE;
+	if (!maxsize) return candidate;
 	
 	// check for possible 8-bit RLE
-	for (size = 0; size <= LONG_RUN_SIZE && current + size < start + insize; size++)
-		if (current[size] != current[0]) break;
+	// (every byte is the same as the one before it)
+	size = 1 + match->delta(current + 1, current, 0, maxsize - 1);
 		
 	// if this is better than the current candidate, use it
-	if (size > LONG_RUN_SIZE) size = LONG_RUN_SIZE;
 	if (size > 2 && size > candidate.size) {
 		candidate.size = size;
 		candidate.data = current[0];
@@ -372,14 +790,16 @@ rle_t rle_check (uint8_t *start, uint8_t *current, uint32_t insize, int fast) {
 	}
 	
 	// check for possible 16-bit RLE
-	uint16_t first = current[0] | (current[1] << 8);
-	for (size = 0; size <= LONG_RUN_SIZE && current + size < start + insize - 1; size += 2) {
-		uint16_t next = current[size] | (current[size + 1] << 8);
-		if (next != first) break;
-	}
+	// (every byte is the same as the one two bytes before it, counting whole pairs only)
+	uint16_t first = 0;
+	if (maxsize >= 2) {
+		first = current[0] | (current[1] << 8);
+		size = match->delta(current + 2, current, 0, maxsize - 2);
+		size = (size & ~1) + 2;
+		if (size > maxsize) size = maxsize & ~1;
+	} else size = 0;
 		
 	// if this is better than the current candidate, use it
-	if (size > LONG_RUN_SIZE) size = LONG_RUN_SIZE;
 	if (size > 2 && size > candidate.size) {
 		candidate.size = size;
 		candidate.data = first;
@@ -392,11 +812,12 @@ rle_t rle_check (uint8_t *start, uint8_t *current, uint32_t insize, int fast) {
 	if (fast) return candidate;
 	
 	// check for possible sequence RLE
-	for (size = 0; size <= LONG_RUN_SIZE && current + size < start + insize; size++)
-		if (current[size] != (current[0] + size)) break;
+	// (every byte is one more than the one before it, without wrapping around from 0xFF to 0x00)
+	uint32_t maxseq = 0x100 - current[0];
+	if (maxseq > maxsize) maxseq = maxsize;
+	size = 1 + match->delta(current + 1, current, 1, maxseq - 1);
 		
 	// if this is better than the current candidate, use it
-	if (size > LONG_RUN_SIZE) size = LONG_RUN_SIZE;
 	if (size > 2 && size > candidate.size) {
 		candidate.size = size;
 		candidate.data = current[0];
@@ -411,78 +832,92 @@ rle_t rle_check (uint8_t *start, uint8_t *current, uint32_t insize, int fast) {
 // Searches for the best possible back reference.
 // start and current are positions within the uncompressed input stream.
 // fast enables fast mode which only uses regular forward references
-backref_t ref_search (uint8_t *start, uint8_t *current, uint32_t insize, tuple_t *offsets, int fast) {
+backref_t ref_search (uint8_t *start, uint8_t *current, uint32_t insize, matcher_t *matcher, int fast) {
 	backref_t candidate = { 0, 0, 0 };
-	uint16_t size;
-	int currbytes;
-	tuple_t *tuple;
+	uint32_t currbytes;
 	
 	// references to previous data which goes in the same direction
-	// see if this byte pair exists elsewhere, then start searching.
 	currbytes = COMBINE(current[0], current[1], current[2], current[3]);
-	HASH_FIND_INT(offsets, &currbytes, tuple);
-	if (tuple) for (uint8_t *pos = start + tuple->offset; pos < current; pos++) {
-		// see how many bytes in a row are the same between the current uncompressed data
-		// and the data at the position being searched
-		for (size = 0; size <= LONG_RUN_SIZE && current + size < start + insize; size++) 
-			if (pos[size] != current[size]) break;
-			
-		// if this is better than the current candidate, use it
-		if (size > LONG_RUN_SIZE) size = LONG_RUN_SIZE;
-		if (size > 3 && size > candidate.size) {
-			candidate.size = size;
-			candidate.offset = pos - start;
-			candidate.method = lz_norm;
-			
-			debug("\tref_search: found new candidate (offset: %4x, size: %d, method = %d)\n", candidate.offset, candidate.size, candidate.method);
-		}
-	}
+	chain_search(start, current, insize, matcher, currbytes, lz_norm, &candidate);
 	
 	// fast mode: forward references only
 	if (fast) return candidate;
 	
 	// references to data where the bits are rotated
-	// see if this byte pair exists elsewhere, then start searching.
 	currbytes = COMBINE(rotate(current[0]), rotate(current[1]), rotate(current[2]), rotate(current[3]));
-	HASH_FIND_INT(offsets, &currbytes, tuple);
-	if (tuple) for (uint8_t *pos = start + tuple->offset; pos < current; pos++) {	
-		// now repeat the check with the bit rotation method
-		for (size = 0; size <= LONG_RUN_SIZE && current + size < start + insize; size++) 
-			if (pos[size] != rotate(current[size])) break;
-				
-		// if this is better than the current candidate, use it
-		if (size > LONG_RUN_SIZE) size = LONG_RUN_SIZE;
-		if (size > 3 && size > candidate.size) {
-			candidate.size = size;
-			candidate.offset = pos - start;
-			candidate.method = lz_rot;
-			
-			debug("\tref_search: found new candidate (offset: %4x, size: %d, method = %d)\n", candidate.offset, candidate.size, candidate.method);
-		}
-	}
+	chain_search(start, current, insize, matcher, currbytes, lz_rot, &candidate);
 	
 	// references to data which goes backwards
-	// see if this byte pair exists elsewhere, then start searching.
 	currbytes = COMBINE(current[3], current[2], current[1], current[0]);
-	HASH_FIND_INT(offsets, &currbytes, tuple);
-	// add 3 to offset since we're starting at the end of the 4 byte sequence here
-	if (tuple) for (uint8_t *pos = start + tuple->offset + 3; pos < current; pos++) {
-		// now repeat the check but go backwards
-		for (size = 0; size <= LONG_RUN_SIZE && current + size < start + insize; size++)
-			if (start[pos - start - size] != current[size]) break;
+	chain_search(start, current, insize, matcher, currbytes, lz_rev, &candidate);
+	
+	return candidate;
+}
+
+// Checks every earlier occurrence of a byte tuple (oldest first) for a back reference
+// using one search method, and replaces the candidate if a longer one is found.
+// Ties always go to the earliest offset, same as a linear scan of the input would.
+void chain_search (uint8_t *start, uint8_t *current, uint32_t insize, matcher_t *matcher,
+                   uint32_t bytes, method_e method, backref_t *candidate) {
+	uint32_t curpos = current - start;
+	uint32_t maxsize = insize - curpos;
+	uint32_t stopsize;
+	uint32_t depth = 0;
+	uint16_t size;
+	tuple_t *tuple;
+	
+	if (maxsize > LONG_RUN_SIZE) maxsize = LONG_RUN_SIZE;
+	stopsize = maxsize;
+	if (matcher->nicesize && matcher->nicesize < stopsize)
+		stopsize = matcher->nicesize;
+	// nothing after this point could be any better
+	if (candidate->size >= stopsize) return;
+	
+	// see if this byte tuple exists elsewhere, then start searching.
+	tuple = tuple_find(matcher->scratch, bytes, 0);
+	if (!tuple) return;
+	
+	for (uint32_t offset = tuple->first; offset != NO_OFFSET; offset = matcher->scratch->next[offset]) {
+		if (matcher->maxchain && depth++ >= matcher->maxchain) break;
+		
+		// see how many bytes in a row are the same between the current uncompressed data
+		// and the data at the position being searched
+		if (method == lz_norm) {
+			uint8_t *pos = start + offset;
+			if (pos >= current) break;
+			
+			size = matcher->match->delta(pos, current, 0, maxsize);
+		
+		} else if (method == lz_rot) {
+			// now repeat the check with the bit rotation method
+			uint8_t *pos = start + offset;
+			if (pos >= current) break;
+			
+			size = matcher->match->rotated(pos, current, maxsize);
+		
+		} else {
+			// add 3 to offset since we're starting at the end of the 4 byte sequence here
+			uint8_t *pos = start + offset + 3;
+			if (pos >= current) break;
+			
+			// now repeat the check but go backwards
+			// (without running past the start of the input)
+			for (size = 0; size < maxsize && size <= offset + 3; size++)
+				if (pos[-size] != current[size]) break;
+		}
 		
 		// if this is better than the current candidate, use it
-		if (size > LONG_RUN_SIZE) size = LONG_RUN_SIZE;
-		if (size > 3 && size > candidate.size) {
-			candidate.size = size;
-			candidate.offset = pos - start;
-			candidate.method = lz_rev;
+		if (size > 3 && size > candidate->size) {
+			candidate->size = size;
+			candidate->offset = offset + (method == lz_rev ? 3 : 0);
+			candidate->method = method;
 			
-			debug("\tref_search: found new candidate (offset: %4x, size: %d, method = %d)\n", candidate.offset, candidate.size, candidate.method);
+			debug("\tref_search: found new candidate (offset: %4x, size: %d, method = %d)\n", candidate->offset, candidate->size, candidate->method);
+			
+			// nothing after this point could be any better
+			if (size >= stopsize) break;
 		}
 	}
-	
-	return candidate;
 }
 
 // Writes a back reference to the compressed output stream.
@@ -594,3 +1029,33 @@ uint16_t write_raw (uint8_t *out, uint16_t outpos, uint8_t *in, uint16_t insize)
 	
 	return outsize;
 }
+
+// Returns the number of bytes write_backref will use for a back reference.
+uint16_t backref_cost (uint16_t size) {
+	return (size - 1 >= RUN_SIZE) ? 4 : 3;
+}
+
+// Returns the number of bytes write_rle will use for RLE data.
+uint16_t rle_cost (rle_t rle) {
+	if (rle.method == rle_16)
+		return (rle.size / 2 - 1 >= RUN_SIZE) ? 4 : 3;
+	
+	return (rle.size - 1 >= RUN_SIZE) ? 3 : 2;
+}
+
+// Returns the number of bytes write_raw will use for uncompressed data.
+uint16_t raw_cost (uint16_t size) {
+	return (size - 1 >= RUN_SIZE) ? size + 2 : size + 1;
+}
+
+// Returns the estimated number of CPU cycles the game uses for a single command
+// which outputs a given number of bytes.
+uint32_t command_cycles (uint8_t command, uint16_t size) {
+	uint32_t cycles = CYCLES_COMMAND + cycles_per_byte[command] * size;
+	
+	if (command == 2) size /= 2;
+	if (size - 1 >= RUN_SIZE) cycles += CYCLES_LONG_COMMAND;
+	if (command >= 4)         cycles += CYCLES_BACKREF;
+	
+	return cycles;
+}
@@ -38,8 +38,36 @@ extern "C" {
 #define RUN_SIZE      32
 #define LONG_RUN_SIZE 1024
 
-size_t pack   (uint8_t *unpacked, size_t inputsize, uint8_t *packed, int fast);
+// compression modes for pack()
+// normal: greedy parsing, uses all compression methods
+// fast:   greedy parsing, no sequence RLE or rotated/reversed back references
+// optimal: finds the smallest combination of all compression methods (slowest)
+// fast decode: like optimal, but avoids methods which are slow for the game to decompress
+//              if they don't save much space
+#define PACK_NORMAL      0
+#define PACK_FAST        1
+#define PACK_OPTIMAL     2
+#define PACK_FAST_DECODE 3
+
+// number of NES CPU cycles in one (NTSC) frame, for use with unpack_cycles()
+// (which only gives a rough estimate, so anything calculated from it is too)
+#define NES_CYCLES_PER_FRAME 29781
+
+// work area used by pack(), which can be allocated once and then reused
+// to avoid any other allocations while compressing.
+// pack() allocates a new one on every call; pack_with_scratch() is the one to use
+// for compressing more than one thing (one work area per thread)
+typedef struct pack_scratch_s pack_scratch_t;
+
+size_t pack   (uint8_t *unpacked, size_t inputsize, uint8_t *packed, int mode);
+size_t pack_with_scratch (uint8_t *unpacked, size_t inputsize, uint8_t *packed, int mode,
+                          pack_scratch_t *scratch);
+pack_scratch_t* pack_scratch_new  (void);
+void            pack_scratch_free (pack_scratch_t *scratch);
 size_t unpack (uint8_t *packed, uint8_t *unpacked);
+size_t unpack_bounded (const uint8_t *packed, size_t packedsize, uint8_t *unpacked, size_t outsize,
+                       size_t *consumed);
+uint32_t unpack_cycles (const uint8_t *packed, size_t packedsize);
 
 size_t unpack_from_file (FILE *file, size_t offset, uint8_t *unpacked);
 
@@ -1,9 +1,13 @@
 #include "graphics.h"
 #include "romfile.h"
 #include <QPixmap>
+#include <vector>
 
-QImage *banks = 0;
+// CHR banks are only decoded the first time they're used
+// (chrROM shares the contents of the ROM that was loaded, without copying it)
+std::vector<QImage> banks;
 uint numBanks = 0;
+ROMView chrROM;
 uint8_t bankTable[3][256];
 
 const romaddr_t bankListPtr[3] = {{0x13, 0xA6A9},
@@ -89,11 +93,10 @@ const QRgb nesPalette[] = {
 uint8_t palettes[BG_PAL_SIZE][BG_PAL_NUM];
 uint8_t sprPalettes[SPR_PAL_NUM][SPR_PAL_SIZE];
 
-void loadCHRBanks(ROMFile& rom) {
+void loadCHRBanks(const ROMView& rom) {
     numBanks = rom.getNumCHRBanks();
-    banks = new QImage[numBanks];
-    for (uint i = 0; i < numBanks; i++)
-        banks[i] = rom.readCHRBank(i);
+    banks.assign(numBanks, QImage());
+    chrROM = rom;
 
     romaddr_t bankLists = {rom.readByte(bankListBank), 0};
     rom.readBytes(bankListPtr[0], 2, &bankLists.addr);
@@ -112,14 +115,25 @@ void loadCHRBanks(ROMFile& rom) {
 }
 
 void freeCHRBanks() {
-    delete[] banks;
-    banks = 0;
+    banks.clear();
+    numBanks = 0;
+    chrROM = ROMView();
+}
+
+// get single CHR bank with the default palette, decoding it if needed
+static const QImage& chrBank(uint bank) {
+    QImage& image = banks[bank % numBanks];
+
+    if (image.isNull())
+        image = chrROM.readCHRBank(bank % numBanks);
+
+    return image;
 }
 
 // get single CHR bank with applied palette
 QImage getCHRBank(uint bank, uint pal) {
-    if (banks) {
-        QImage newBank(banks[bank % numBanks]);
+    if (numBanks) {
+        QImage newBank(chrBank(bank));
 
         // apply palette
         for (uint i = 0; i < 10; i++)
@@ -135,8 +149,8 @@ QImage getCHRBank(uint bank, uint pal) {
 }
 
 QImage getCHRSpriteBank(uint bank, uint pal) {
-    if (banks) {
-        QImage newBank(banks[bank % numBanks]);
+    if (numBanks) {
+        QImage newBank(chrBank(bank));
 
         // apply palette
         for (uint i = 0; i < 6; i++) {
@@ -149,7 +163,7 @@ QImage getCHRSpriteBank(uint bank, uint pal) {
     } else return QImage();
 }
 
-void saveBankTables(ROMFile& file, romaddr_t addr) {
+void saveBankTables(ROMFile& file, romaddr_t addr, const uint8_t (*tables)[256]) {
     // bank table pointers mapped to 0x8000-0x9FFF
     addr.addr %= BANK_SIZE;
     addr.addr += 0x8000;
@@ -160,16 +174,17 @@ void saveBankTables(ROMFile& file, romaddr_t addr) {
     // write three tables and the pointers to them
     for (uint i = 0; i < 3; i++) {
         file.writeInt16(bankListPtr[i], addr.addr + (i * 0x100));
-        file.writeBytes(addr + (i * 0x100), 0x100, bankTable[i]);
+        file.writeBytes(addr + (i * 0x100), 0x100, tables[i]);
     }
 }
 
-void savePalettes(ROMFile& file) {
+void savePalettes(ROMFile& file, const uint8_t (*bgPalettes)[BG_PAL_NUM],
+                  const uint8_t (*spritePalettes)[SPR_PAL_SIZE]) {
     // background palettes
     for (uint i = 0; i < BG_PAL_SIZE; i++)
-        file.writeBytes(palAddr + BG_PAL_NUM*i, BG_PAL_NUM, &palettes[i][0]);
+        file.writeBytes(palAddr + BG_PAL_NUM*i, BG_PAL_NUM, &bgPalettes[i][0]);
 
     // sprite palettes
     for (uint i = 0; i < SPR_PAL_NUM; i++)
-        file.writeBytes(sprPalAddr + SPR_PAL_SIZE*i, SPR_PAL_SIZE, &sprPalettes[i][0]);
+        file.writeBytes(sprPalAddr + SPR_PAL_SIZE*i, SPR_PAL_SIZE, &spritePalettes[i][0]);
 }
@@ -22,11 +22,12 @@ extern uint8_t bankTable[][256];
 extern uint8_t palettes[BG_PAL_SIZE][BG_PAL_NUM];
 extern uint8_t sprPalettes[SPR_PAL_NUM][SPR_PAL_SIZE];
 
-void loadCHRBanks(ROMFile& rom);
+void loadCHRBanks(const ROMView& rom);
 void freeCHRBanks();
 QImage getCHRBank(uint bank, uint pal);
 QImage getCHRSpriteBank(uint bank, uint pal);
-void saveBankTables(ROMFile& file, romaddr_t addr);
-void savePalettes(ROMFile& file);
+void saveBankTables(ROMFile& file, romaddr_t addr, const uint8_t (*tables)[256]);
+void savePalettes(ROMFile& file, const uint8_t (*bgPalettes)[BG_PAL_NUM],
+                  const uint8_t (*spritePalettes)[SPR_PAL_SIZE]);
 
 #endif // GRAPHICS_H
@@ -15,11 +15,10 @@
 #include <cstring>
 #include <cstdlib>
 #include <cstdint>
-#include <list>
 #include <iostream>
 #include <stdexcept>
+#include <vector>
 
-#include <QMessageBox>
 #include <QString>
 #include <QCoreApplication>
 
@@ -44,11 +43,19 @@ const uint      ptrExitsB   = 0x12;
 const romaddr_t bossExits   = {0x12, 0x9c4a};
 const romaddr_t extraData   = {0x12, 0x9e92};
 
+// pointer tables (for ROMFile::pointerTable or ROMView::pointerTable)
+#define MAP_DATA_POINTERS ptrMapDataL, ptrMapDataH, ptrMapDataB, NUM_LEVELS
+#define SPRITE_POINTERS   ptrSpritesL, ptrSpritesH, ptrSpritesB, NUM_LEVELS
+// (there's one more exit pointer than there are levels, since the number of exits
+//  is calculated from the difference between consecutive pointers)
+#define EXIT_POINTERS     ptrExitsL, ptrExitsH, ptrExitsB, NUM_LEVELS + 1
+
 /*
   Load a level by number. Returns pointer to the level data as a struct.
-  Returns null if a level failed and the user decided not to continue.
+  Returns null if a level failed, along with the reason through "error" (if given).
+  This can be called for different levels from several threads at once.
 */
-leveldata_t* loadLevel (ROMFile& file, uint num) {
+leveldata_t* loadLevel (const ROMView& file, uint num, QString *error) {
     //invalid data should at least be able to decompress fully
     uint8_t  buf[DATA_SIZE] = {0};
     header_t *header  = (header_t*)buf + 0;
@@ -56,18 +63,18 @@ leveldata_t* loadLevel (ROMFile& file, uint num) {
     uint8_t  *extra   = screens + 16;
     uint8_t  *tiles   = buf + 0xDA;
 
-    size_t result = file.readFromPointer(ptrMapDataL, ptrMapDataH, ptrMapDataB, 0, buf, num);
+    size_t result = file.readFromPointer(file.pointerTable(MAP_DATA_POINTERS), 0, buf, num);
     // TODO: "error reading level, attempt to continue?"
-    if (result == 0) return NULL;
+    if (result == 0) {
+        if (error) *error = QString("Unable to read room %1.").arg(num);
+        return NULL;
+    }
 
     leveldata_t *level;
     try {
         level = new leveldata_t;
     } catch (std::bad_alloc) {
-        QMessageBox::critical(0,
-                              "Load ROM",
-                              QString("Unable to allocate memory for room %1").arg(num),
-                              QMessageBox::Ok);
+        if (error) *error = QString("Unable to allocate memory for room %1").arg(num);
         return NULL;
     }
 
@@ -77,11 +84,7 @@ leveldata_t* loadLevel (ROMFile& file, uint num) {
     if (header->screensH * header->screensV > 16
             || header->screensH == 0
             || header->screensV == 0) {
-        QMessageBox::critical(0,
-                              "Load ROM",
-                              QString("Unable to load room %1 because it has an invalid size.\n\n"
-                                      "The ROM may be corrupt.").arg(num),
-                              QMessageBox::Ok);
+        if (error) *error = QString("Unable to load room %1 because it has an invalid size.").arg(num);
 
         delete level;
         return NULL;
@@ -110,13 +113,22 @@ leveldata_t* loadLevel (ROMFile& file, uint num) {
         level->extra.doorBottom = extra[5];
     }
 
-    // kinda slow, but eh
-    for (uint y = 0; y < SCREEN_HEIGHT * header->screensV; y++) {
-        for (uint x = 0; x < SCREEN_WIDTH * header->screensH; x++) {
-            uint idx = (y / SCREEN_HEIGHT * header->screensH) + (x / SCREEN_WIDTH);
-            uint8_t screen = screens[idx];
-            level->tiles[y][x] = tiles[(screen * SCREEN_SIZE)
-                    + (y % SCREEN_HEIGHT * 16) + (x % SCREEN_WIDTH)];
+    // screens that use the same data in the ROM are shared
+    // (until one of them is changed)
+    int firstUse[0x100];
+    std::fill(firstUse, firstUse + 0x100, -1);
+
+    for (uint i = 0; i < (uint)header->screensH * header->screensV; i++) {
+        uint8_t screen = screens[i];
+        uint h = i % header->screensH;
+        uint v = i / header->screensH;
+
+        if (firstUse[screen] >= 0) {
+            level->tiles.shareScreen(h, v, firstUse[screen] % header->screensH,
+                                     firstUse[screen] / header->screensH);
+        } else {
+            level->tiles.setScreen(h, v, tiles + (screen * SCREEN_SIZE));
+            firstUse[screen] = i;
         }
     }
 
@@ -125,10 +137,10 @@ leveldata_t* loadLevel (ROMFile& file, uint num) {
 
     // get "don't return on death" flag
     // (which is the highest bit of the level pointer's bank byte)
-    level->noReturn = file.readByte(ptrMapDataB + num) & 0x80;
+    level->noReturn = file.pointerTable(MAP_DATA_POINTERS).bankByte(num) & 0x80;
 
     // get sprite data
-    romaddr_t spritePtr = file.readPointer(ptrSpritesL, ptrSpritesH, ptrSpritesB, num);
+    romaddr_t spritePtr = file.pointerTable(SPRITE_POINTERS)[num];
     // true number of screens (this may differ in levels more than 2 screens tall)
     uint sprScreens = file.readByte(spritePtr);
 
@@ -145,145 +157,150 @@ leveldata_t* loadLevel (ROMFile& file, uint num) {
         // number of sprites on this screen
         numSprites = file.readByte(spriteCounts + i);
         while (sprNum < numSprites) {            
-            sprite_t *sprite = new sprite_t;
+            sprite_t sprite = {0};
 
-            sprite->type = file.readByte(spriteTypes + sprNum);
+            sprite.type = file.readByte(spriteTypes + sprNum);
 
             uint8_t pos  = file.readByte(spritePos + sprNum);
 
             // calculate normal x/y positions
-            sprite->x = (i % header->screensH * SCREEN_WIDTH) + (pos >> 4);
+            sprite.x = screenLeft(i, header->screensH) + (pos >> 4);
             // for some stupid reason, HAL designed the sprite data so that
             // sprite coords / screen positions are based on screens being
             // 16 tiles tall instead of 12. changing this should put sprites
             // in the correct place all the time on vertical levels.
             // (fixes issue #2)
-            sprite->y = (i / header->screensH * (SCREEN_HEIGHT + 4)) + (pos & 0xF);
+            sprite.y = screenTop(i, header->screensH, SCREEN_HEIGHT + 4) + (pos & 0xF);
 
-            level->sprites.push_back(sprite);
+            level->sprites.add(sprite);
             sprNum++;
         }
     }
 
     // get exit data
-    romaddr_t exits     = file.readShortPointer(ptrExitsL, ptrExitsH, ptrExitsB, num);
-    romaddr_t nextExits = file.readShortPointer(ptrExitsL, ptrExitsH, ptrExitsB, num+1);
+    const PointerTable& exitTable = file.pointerTable(EXIT_POINTERS);
+    romaddr_t exits     = exitTable[num];
+    romaddr_t nextExits = exitTable[num+1];
     // the game subtracts consecutive pointers to calculate # of exits in current level
     uint numExits = (nextExits.addr - exits.addr) / 5;
+    level->exits.reserve(numExits);
     for (uint i = 0; i < numExits; i++) {
-        exit_t *exit = new exit_t;
+        exit_t exit = {0};
         romaddr_t thisExit = exits + (i * 5);
         uint8_t byte;
 
         // byte 0: exit type / screen
         byte = file.readByte(thisExit);
         uint screen = byte & 0xF;
-        exit->type = byte >> 4;
+        exit.type = byte >> 4;
 
         // byte 1: coordinates
         byte = file.readByte(thisExit + 1);
-        exit->x = (screen % header->screensH * SCREEN_WIDTH) + (byte >> 4);
-        exit->y = (screen / header->screensH * SCREEN_HEIGHT) + (byte & 0xF);
+        exit.x = screenLeft(screen, header->screensH) + (byte >> 4);
+        exit.y = screenTop(screen, header->screensH) + (byte & 0xF);
 
         // byte 2: LSB of destination
-        exit->dest = file.readByte(thisExit + 2);
+        exit.dest = file.readByte(thisExit + 2);
 
         // byte 3: MSB of destination / type / dest screen
         byte = file.readByte(thisExit + 3);
         if (byte & 0x80)
-            exit->dest |= 0x100;
-        exit->type |= (byte & 0x70);
-        exit->destScreen = byte & 0xF;
+            exit.dest |= 0x100;
+        exit.type |= (byte & 0x70);
+        exit.destScreen = byte & 0xF;
 
         // byte 4: dest coordinates
         byte = file.readByte(thisExit + 4);
-        exit->destX = byte >> 4;
-        exit->destY = byte & 0xF;
+        exit.destX = byte >> 4;
+        exit.destY = byte & 0xF;
 
         // if this is a "next level/boss" door, get that info too
-        if (num < 8 && exit->type == 0x1F) {
-            exit->bossLevel = file.readByte(bossExits + (num * 3));
+        if (num < 8 && exit.type == 0x1F) {
+            exit.bossLevel = file.readByte(bossExits + (num * 3));
 
             byte = file.readByte(bossExits + (num * 3) + 1);
             if (byte & 0x80)
-                exit->bossLevel |= 0x100;
+                exit.bossLevel |= 0x100;
 
-            exit->bossScreen = byte & 0xF;
+            exit.bossScreen = byte & 0xF;
 
             byte = file.readByte(bossExits + (num * 3) + 2);
-            exit->bossX = byte >> 4;
-            exit->bossY = byte & 0xF;
+            exit.bossX = byte >> 4;
+            exit.bossY = byte & 0xF;
         } else {
-            exit->bossLevel = 0;
-            exit->bossScreen = 0;
-            exit->bossX = 0;
-            exit->bossY = 0;
+            exit.bossLevel = 0;
+            exit.bossScreen = 0;
+            exit.bossX = 0;
+            exit.bossY = 0;
         }
 
-        level->exits.push_back(exit);
+        level->exits.add(exit);
     }
 
+    // get extra info from the original table, if it's still being used
+    readExtraData(file, level, num);
+
     level->modified = false;
 
     return level;
 }
 
 /*
- * Try to read extra map info from the original table if it exists,
- * or mark that the extra map info patch has been applied to the ROM otherwise.
+ * Returns true if the extra map info patch has already been applied to the ROM
+ * (in which case extra info is stored with each level's map data instead.)
  */
-void readExtraData(ROMFile &file, leveldata_t **levels) {
-    if (file.readByte(extraData) == 'K' &&
-        file.readByte(extraData+1) == 'A' &&
-        file.readByte(extraData+2) == 'L' &&
-        file.readByte(extraData+3) == 'E') {
+bool hasExtraDataPatch(const ROMView &file) {
+    return file.readByte(extraData) == 'K' &&
+           file.readByte(extraData+1) == 'A' &&
+           file.readByte(extraData+2) == 'L' &&
+           file.readByte(extraData+3) == 'E';
+}
 
-        leveldata_t::hasExtra = true;
+/*
+ * Try to read extra map info for a level from the original table if it exists.
+ */
+void readExtraData(const ROMView &file, leveldata_t *level, uint num) {
+    if (hasExtraDataPatch(file))
         return;
-    }
 
-    leveldata_t::hasExtra = false;
     romaddr_t addr = extraData;
     uint8_t bytes[6];
 
-    while (true) {
-        file.readBytes(addr, 6, bytes);
+    for (; file.readBytes(addr, 6, bytes) == 6; addr.addr += 6) {
         if (bytes[0] == 0xFF && bytes[1] == 0xFF) {
             return;
         }
 
-        int level = (bytes[0] + (bytes[1] << 8)) & 0x1FF;
-        if (level >= NUM_LEVELS) continue;
+        if (((bytes[0] + (bytes[1] << 8)) & 0x1FF) != num) continue;
 
         if (bytes[2] == 0xFE) {
-            levels[level]->extra.wind = bytes[3] + 1;
+            level->extra.wind = bytes[3] + 1;
 
         } else if (bytes[2] == 0xFF) {
-            levels[level]->extra.bossCount = (bytes[1] >> 1) + 1;
-            levels[level]->extra.lock = true;
-            levels[level]->extra.lockPos = bytes[4] + (bytes[5] << 8);
+            level->extra.bossCount = (bytes[1] >> 1) + 1;
+            level->extra.lock = true;
+            level->extra.lockPos = bytes[4] + (bytes[5] << 8);
 
         } else {
-            levels[level]->extra.bossCount = (bytes[1] >> 1) + 1;
-            levels[level]->extra.lock = false;
-            levels[level]->extra.doorX = bytes[2];
-            levels[level]->extra.doorY = bytes[3];
-            levels[level]->extra.doorTop = bytes[4];
-            levels[level]->extra.doorBottom = bytes[5];
+            level->extra.bossCount = (bytes[1] >> 1) + 1;
+            level->extra.lock = false;
+            level->extra.doorX = bytes[2];
+            level->extra.doorY = bytes[3];
+            level->extra.doorTop = bytes[4];
+            level->extra.doorBottom = bytes[5];
         }
-
-        addr.addr += 6;
     }
-
 }
 
 /*
- * Returns a compressed data chunk based on level data (tile map only).
- * This is inserted into the big list of data chunks and then
- * later passed back to saveLevel in order to save it to the ROM
+ * Returns a data chunk based on level data (tile map only).
+ * This is inserted into the big list of data chunks, compressed along with the others,
+ * and then later passed back to saveLevel in order to save it to the ROM
  * (and add it to the pointer table).
+ * Extra data is only included if hasExtra is set (i.e. leveldata_t::hasExtra, as of
+ * when the save started.)
  */
-DataChunk packLevel(const leveldata_t *level, uint num) {
+DataChunk packLevel(const leveldata_t *level, uint num, bool hasExtra) {
     uint8_t buf[MAP_DATA_SIZE] = {0};
     header_t *header  = (header_t*)buf + 0;
     uint8_t  *screens = buf + 8;
@@ -295,7 +312,7 @@ DataChunk packLevel(const leveldata_t *level, uint num) {
     uint numScreens = level->header.screensV * level->header.screensH;
 
     // save extra data
-    if (leveldata_t::hasExtra) {
+    if (hasExtra) {
         extra[0] = level->extra.wind;
         extra[1] = level->extra.bossCount;
 
@@ -311,21 +328,14 @@ DataChunk packLevel(const leveldata_t *level, uint num) {
         }
     }
 
-    // all current unique screens
-    uint8_t uniques[16][SCREEN_SIZE] = {{0}};
+    // all current unique screens (by position in the level) and their hashes
+    uint     uniques[16] = {0};
+    uint64_t hashes[16]  = {0};
     uint unique = 0;
 
     for (uint i = 0; i < numScreens; i++) {
-        // temporary screen
-        uint8_t tempScreen[SCREEN_SIZE] = {0};
-
-        // write tile data for screen
         uint h = i % header->screensH;
         uint v = i / header->screensH;
-        for (uint y = 0; y < SCREEN_HEIGHT; y++) {
-            memcpy(tempScreen + (y * SCREEN_WIDTH),
-                   &level->tiles[v * SCREEN_HEIGHT + y][h * SCREEN_WIDTH], SCREEN_WIDTH);
-        }
 
         // combine unique screens instead of writing multiple copies of them.
         // this is currently only done for rotating tower rooms (0CD, 0D4, 0DF, 0E6)
@@ -334,9 +344,12 @@ DataChunk packLevel(const leveldata_t *level, uint num) {
         // affect more than one part of the level at the same time.
         if (num == 0xCD || num == 0xD4 || num == 0xDF || num == 0xE6) {
             // does an identical screen already exist?
+            uint64_t hash = level->tiles.screenHash(h, v);
             bool found = false;
             for (uint s = 0; !found && s < unique; s++) {
-                if (!memcmp(uniques[s], tempScreen, SCREEN_SIZE)) {
+                if (hashes[s] == hash
+                        && level->tiles.sameScreen(h, v, uniques[s] % header->screensH,
+                                                   uniques[s] / header->screensH)) {
                     // reuse the same screen index
                     screens[i] = s;
                     found = true;
@@ -345,18 +358,17 @@ DataChunk packLevel(const leveldata_t *level, uint num) {
             if (found) continue;
 
             // add this screen to the unique screens
-            memcpy(uniques[unique], tempScreen, SCREEN_SIZE);
+            uniques[unique] = i;
+            hashes[unique]  = hash;
         }
 
         // write the new unique screen to the level data
-        uint8_t *newScreen = tiles + (SCREEN_SIZE * unique);
-        memcpy(newScreen, tempScreen, SCREEN_SIZE);
+        level->tiles.readScreen(h, v, tiles + (SCREEN_SIZE * unique));
 
         // use a new screen index
         screens[i] = unique++;
     }
 
-    // pack and return
     return DataChunk(buf, 0xDA + (SCREEN_SIZE * numScreens),
                      DataChunk::level, num);
 }
@@ -365,22 +377,15 @@ DataChunk packSprites(const leveldata_t *level, uint num) {
     uint8_t buf[DATA_SIZE] = {0};
 
     // sort sprites by screen
-    std::list<sprite_t> sprites;
-
-    for (std::list<sprite_t*>::const_iterator i = level->sprites.begin();
-         i != level->sprites.end(); i++) {
-
-        sprite_t sprite = *(*i);
+    std::vector<sprite_t> sprites(level->sprites.begin(), level->sprites.end());
 
+    for (std::vector<sprite_t>::iterator i = sprites.begin(); i != sprites.end(); i++) {
         // which screen is this sprite on?
         // (treat screens as 16 tiles tall instead of 12 - fixes issue #2)
-        sprite.screen = (sprite.y / (SCREEN_HEIGHT + 4) * level->header.screensH)
-                      + (sprite.x / SCREEN_WIDTH);
-
-        sprites.push_back(sprite);
+        i->screen = screenNum(i->x, i->y, level->header.screensH, SCREEN_HEIGHT + 4);
     }
 
-    sprites.sort();
+    std::stable_sort(sprites.begin(), sprites.end());
 
     uint numScreens = level->header.screensH * level->header.screensV;
     uint numSprites = sprites.size();
@@ -394,8 +399,8 @@ DataChunk packSprites(const leveldata_t *level, uint num) {
     buf[1] = level->header.screensV;
 
     uint sprNum = 0;
-    for (std::list<sprite_t>::const_iterator i = sprites.begin(); i != sprites.end(); i++) {
-        sprite_t sprite = *i;
+    for (std::vector<sprite_t>::const_iterator i = sprites.begin(); i != sprites.end(); i++) {
+        const sprite_t& sprite = *i;
 
         // update sprites-per-screen counts
         for (uint j = sprite.screen; j < numScreens; j++)
@@ -426,7 +431,7 @@ void saveLevel(ROMFile& file, const DataChunk &chunk, const leveldata_t *level,
 
     // save compressed data chunk, update pointer table
     uint num = chunk.num;
-    file.writeToPointer(ptrMapDataL, ptrMapDataH, ptrMapDataB, addr, chunk.size, chunk.data, num);
+    file.writeToPointer(file.pointerTable(MAP_DATA_POINTERS), addr, chunk.size, chunk.data.data(), num);
 
     // write tileset number
     file.writeByte(mapTilesets + num, level->tileset);
@@ -434,17 +439,17 @@ void saveLevel(ROMFile& file, const DataChunk &chunk, const leveldata_t *level,
 }
 
 void saveExits(ROMFile& file, const leveldata_t *level, uint num) {
-    romaddr_t addr = file.readShortPointer(ptrExitsL, ptrExitsH, ptrExitsB, num);
+    PointerTable& exitTable = file.pointerTable(EXIT_POINTERS);
+    romaddr_t addr = exitTable[num];
 
-    for (std::list<exit_t*>::const_iterator i = level->exits.begin(); i != level->exits.end(); i++) {
-        exit_t *exit = *i;
+    for (ObjectList<exit_t>::const_iterator i = level->exits.begin(); i != level->exits.end(); i++) {
+        const exit_t *exit = &*i;
         uint8_t bytes[5];
 
         // byte 0: upper 4 = exit type & 0xF, lower 4 = screen exit is on
         bytes[0] = exit->type << 4;
         // calculate screen number
-        bytes[0] |= (exit->y / SCREEN_HEIGHT * level->header.screensH)
-                  + (exit->x / SCREEN_WIDTH);
+        bytes[0] |= screenNum(exit->x, exit->y, level->header.screensH);
 
         // byte 1: upper 4 = x, lower 4 = y
         bytes[1] = ((exit->x % SCREEN_WIDTH) << 4) | (exit->y % SCREEN_HEIGHT);
@@ -480,8 +485,7 @@ void saveExits(ROMFile& file, const leveldata_t *level, uint num) {
     }
 
     // write pointer for NEXT level
-    file.writeByte(ptrExitsL + num + 1, addr.addr & 0xFF);
-    file.writeByte(ptrExitsH + num + 1, addr.addr >> 8);
+    exitTable.set(num + 1, addr);
 }
 
 void saveSprites(ROMFile& file, const DataChunk& chunk, romaddr_t addr) {
@@ -491,5 +495,5 @@ void saveSprites(ROMFile& file, const DataChunk& chunk, romaddr_t addr) {
 
     // save compressed data chunk, update pointer table
     uint num = chunk.num;
-    file.writeToPointer(ptrSpritesL, ptrSpritesH, ptrSpritesB, addr, chunk.size, chunk.data, num);
+    file.writeToPointer(file.pointerTable(SPRITE_POINTERS), addr, chunk.size, chunk.data.data(), num);
 }
@@ -7,12 +7,10 @@
 #define LEVEL_H
 
 #include "romfile.h"
+#include "tilemap.h"
+#include <QVector>
+#include <algorithm>
 #include <cstdint>
-#include <list>
-
-#define SCREEN_WIDTH  16
-#define SCREEN_HEIGHT 12
-#define SCREEN_SIZE   (SCREEN_HEIGHT * SCREEN_WIDTH)
 
 // high/low parts of level pointer table are 328 bytes apart;
 // the last one seems to be bogus
@@ -46,6 +44,8 @@ struct sprite_t {
     uint8_t screen;
     bool operator< (const sprite_t &other) const { return screen < other.screen; }
 
+    // assigned by ObjectList
+    uint id;
 };
 
 struct exit_t {
@@ -53,12 +53,72 @@ struct exit_t {
     uint x, y;
     uint dest, destScreen, destX, destY;
     uint bossLevel, bossScreen, bossX, bossY;
+
+    // assigned by ObjectList
+    uint id;
+};
+
+/*
+  A level's sprites or exits, stored by value in the order they were added.
+  Each one gets an ID when it's added which stays the same until it's removed,
+  so things like scene items can refer to them even after the list has changed.
+  Copies of a list share the same data until one of them is changed.
+*/
+template<typename T> class ObjectList {
+public:
+    typedef typename QVector<T>::const_iterator const_iterator;
+
+    ObjectList() : objects(), nextID(0) {}
+
+    const_iterator begin() const { return objects.constBegin(); }
+    const_iterator end()   const { return objects.constEnd(); }
+
+    size_t size()  const { return objects.size(); }
+    bool   empty() const { return objects.isEmpty(); }
+    void   clear()       { objects.clear(); }
+    void   reserve(size_t size) { objects.reserve(size); }
+
+    T& add(T object) {
+        object.id = nextID++;
+        objects.append(object);
+        return objects.last();
+    }
+
+    // returns null if there's nothing with this ID
+    const T* find(uint id) const {
+        int i = indexOf(id);
+        return i < 0 ? NULL : &objects.at(i);
+    }
+    // same as find, but for changing the object
+    T* modify(uint id) {
+        int i = indexOf(id);
+        return i < 0 ? NULL : &objects[i];
+    }
+
+    void remove(uint id) {
+        int i = indexOf(id);
+        if (i >= 0)
+            objects.remove(i);
+    }
+
+private:
+    QVector<T> objects;
+    uint       nextID;
+
+    // (IDs are always in increasing order, so this can just do a binary search)
+    int indexOf(uint id) const {
+        const_iterator i = std::lower_bound(begin(), end(), id,
+                                            [](const T& object, uint id) { return object.id < id; });
+        return (i != end() && i->id == id) ? i - begin() : -1;
+    }
 };
 
 /*
   Definition for level data.
   Currently consists of tile and obstacle data and flags, as well as modified state,
   tileset #, and sprites/exits.
+  Copying a level is cheap; the tiles and sprites/exits are shared between copies
+  until they're changed.
 */
 struct leveldata_t {
     header_t  header;
@@ -66,14 +126,14 @@ struct leveldata_t {
 
     // The maximum number of screens in a map is 16 (due to memory limits),
     // and each screen is 16x12 tiles.
-    uint8_t   tiles[16 * SCREEN_HEIGHT][16 * SCREEN_WIDTH];
+    TileMap   tiles;
 
     // tileset number
     uint8_t   tileset;
 
     // containers for other data
-    std::list<sprite_t*> sprites;
-    std::list<exit_t*>   exits;
+    ObjectList<sprite_t> sprites;
+    ObjectList<exit_t>   exits;
 
     // don't return to this level after losing a life?
     bool      noReturn;
@@ -82,15 +142,7 @@ struct leveldata_t {
     // (set when modified, cleared when saved)
     bool      modified;
 
-    leveldata_t() : tiles {{0}}, sprites(), exits() {}
-    ~leveldata_t() {
-        // cleanup sprites/exits
-        for (std::list<sprite_t*>::iterator i = sprites.begin(); i != sprites.end(); i++)
-            delete *i;
-
-        for (std::list<exit_t*>::iterator i = exits.begin(); i != exits.end(); i++)
-            delete *i;
-    }
+    leveldata_t() : tiles(), sprites(), exits() {}
 
     // has the extra map data patch been applied or not?
     static bool hasExtra;
@@ -99,9 +151,10 @@ struct leveldata_t {
 /*
   Functions for loading/saving level data
 */
-leveldata_t*  loadLevel(ROMFile& file, uint num);
-void          readExtraData(ROMFile& file, leveldata_t **levels);
-DataChunk     packLevel  (const leveldata_t *level, uint num);
+leveldata_t*  loadLevel(const ROMView& file, uint num, QString *error = 0);
+bool          hasExtraDataPatch(const ROMView& file);
+void          readExtraData(const ROMView& file, leveldata_t *level, uint num);
+DataChunk     packLevel  (const leveldata_t *level, uint num, bool hasExtra);
 DataChunk     packSprites(const leveldata_t *level, uint num);
 void          saveLevel(ROMFile& file, const DataChunk &chunk, const leveldata_t *level, romaddr_t offset);
 void          saveExits(ROMFile& file, const leveldata_t *level, uint num);
@@ -1,9 +1,53 @@
 #include <QtWidgets/QApplication>
+#include <QCommandLineParser>
+#include <cstdio>
+#include <cstring>
 #include "mainwindow.h"
+#include "patches.h"
 #include "version.h"
 
+/*
+  Applies patches to a ROM from the command line without opening the editor, i.e.:
+  kale --apply-patch first.ips --apply-patch second.ips rom.nes [output.nes]
+*/
+static int applyPatches(QCoreApplication &a) {
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addOption(QCommandLineOption("apply-patch",
+                                        QCoreApplication::translate("main", "Apply an IPS patch (can be used more than once)."),
+                                        "patch"));
+    parser.addPositionalArgument("rom", QCoreApplication::translate("main", "ROM to apply patches to."));
+    parser.addPositionalArgument("output", QCoreApplication::translate("main", "Where to save the patched ROM (default: overwrite the original)."),
+                                 "[output]");
+    parser.process(a);
+
+    QStringList files = parser.positionalArguments();
+    if (files.isEmpty() || files.size() > 2)
+        parser.showHelp(1);
+
+    QString error;
+    if (!applyPatchesToFile(parser.values("apply-patch"), files[0],
+                            files.size() > 1 ? files[1] : QString(), &error)) {
+        fprintf(stderr, "%s\n", qPrintable(error));
+        return 1;
+    }
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--apply-patch", 13)) {
+            QCoreApplication a(argc, argv);
+            a.setApplicationName(INFO_NAME);
+            a.setApplicationVersion(INFO_VERS);
+
+            return applyPatches(a);
+        }
+    }
+
     QApplication a(argc, argv);
 
     a.setApplicationName(INFO_NAME);
@@ -11,6 +55,6 @@ int main(int argc, char *argv[])
 
     MainWindow w;
     w.show();
-    
+
     return a.exec();
 }
@@ -15,11 +15,17 @@
 #include <QCloseEvent>
 #include <QMessageBox>
 #include <QFileDialog>
+#include <QFileInfo>
 #include <QDesktopServices>
 #include <QUrl>
+#include <QEventLoop>
+#include <QFutureWatcher>
+#include <QtConcurrent>
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <vector>
 
 #include "romfile.h"
 #include "level.h"
@@ -40,6 +46,8 @@ MainWindow::MainWindow(QWidget *parent) :
     ui(new Ui::MainWindow),
     levelLabel(new QLabel()),
     selectGroup(new QActionGroup(this)),
+    saveProgressBar(new QProgressBar()),
+    cancelSaveButton(new QPushButton(tr("Cancel"))),
 
     settings(new QSettings(
                  QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/settings.ini",
@@ -48,6 +56,7 @@ MainWindow::MainWindow(QWidget *parent) :
     fileOpen(false),
     unsaved(false),
     saving(false),
+    saveJob(NULL),
     level(0),
 
     scene(new MapScene(this, &currentLevel)),
@@ -81,6 +90,13 @@ MainWindow::MainWindow(QWidget *parent) :
     // remove margins around map view and other stuff
     this->centralWidget()->layout()->setContentsMargins(0,0,0,0);
 
+    // save progress (only shown while saving)
+    ui->statusBar->addPermanentWidget(saveProgressBar);
+    ui->statusBar->addPermanentWidget(cancelSaveButton);
+    saveProgressBar->setMaximumWidth(200);
+    saveProgressBar->hide();
+    cancelSaveButton->hide();
+
     setupSignals();
     setupActions();
     getSettings();
@@ -119,12 +135,21 @@ void MainWindow::setupSignals() {
                      this, SLOT(saveFile()));
     QObject::connect(ui->action_Save_ROM_As, SIGNAL(triggered()),
                      this, SLOT(saveFileAs()));
+    QObject::connect(ui->action_Save_Patch, SIGNAL(triggered()),
+                     this, SLOT(saveFileAsPatch()));
     QObject::connect(ui->action_Close_ROM, SIGNAL(triggered()),
                      this, SLOT(closeFile()));
 
     QObject::connect(ui->action_Exit, SIGNAL(triggered()),
                      this, SLOT(close()));
 
+    QObject::connect(cancelSaveButton, SIGNAL(clicked()),
+                     this, SLOT(cancelSave()));
+    QObject::connect(&saveWatcher, SIGNAL(finished()),
+                     this, SLOT(saveFinished()));
+    QObject::connect(&decodeTimeWatcher, SIGNAL(finished()),
+                     this, SLOT(decodeTimeFinished()));
+
     // edit menu
     QObject::connect(ui->action_Undo, SIGNAL(triggered()),
                      scene, SLOT(undo()));
@@ -269,6 +294,9 @@ void MainWindow::getSettings() {
     if (settings->value("MainWindow/maximized", false).toBool())
         this      ->showMaximized();
 
+    ui->action_Keep_Pack_Cache->setChecked(settings->value("MainWindow/keepPackCache", false).toBool());
+    ui->action_Fast_Decode->setChecked(settings->value("MainWindow/fastDecode", false).toBool());
+
     // display friendly message
     status(tr("Welcome to KALE, version %1.")
            .arg(INFO_VERS));
@@ -280,6 +308,8 @@ void MainWindow::saveSettings() {
     settings->setValue("MainWindow/maximized", this->isMaximized());
     if (!this->isMaximized())
         settings->setValue("MainWindow/geometry", this->geometry());
+    settings->setValue("MainWindow/keepPackCache", ui->action_Keep_Pack_Cache->isChecked());
+    settings->setValue("MainWindow/fastDecode", ui->action_Fast_Decode->isChecked());
 }
 
 /*
@@ -301,13 +331,15 @@ void MainWindow::setOpenFileActions(bool val) {
     ui->action_Select_Level       ->setEnabled(val);
     ui->action_Save_Level_to_Image->setEnabled(val);
     setEditActions(val);
+    setSaveActions(val);
     setLevelChangeActions(val);
-    // setEditActions may disable this
+    // setSaveActions may disable this
     ui->action_Open_ROM->setEnabled(true);
 }
 
 /*
-  actions that are disabled while saving the file
+  editing actions
+  (these stay enabled while the file is being saved in the background)
 */
 void MainWindow::setEditActions(bool val) {
     setUndoRedoActions(val);
@@ -315,10 +347,6 @@ void MainWindow::setEditActions(bool val) {
     ui->action_Copy            ->setEnabled(val);
     ui->action_Paste           ->setEnabled(val);
     ui->action_Delete          ->setEnabled(val);
-    ui->action_Close_ROM       ->setEnabled(val);
-    ui->action_Open_ROM        ->setEnabled(val);
-    ui->action_Save_ROM        ->setEnabled(val);
-    ui->action_Save_ROM_As     ->setEnabled(val);
     ui->action_Save_Level      ->setEnabled(val);
     ui->action_Edit_Tiles      ->setEnabled(val);
     ui->action_Select_Tiles    ->setEnabled(val);
@@ -331,6 +359,17 @@ void MainWindow::setEditActions(bool val) {
     ui->action_Edit_Tilesets   ->setEnabled(val);
     ui->action_Edit_Palettes   ->setEnabled(val);
     ui->action_Edit_Map_Clear_Data->setEnabled(val && level < 7);
+}
+
+/*
+  actions that are disabled while saving the file
+*/
+void MainWindow::setSaveActions(bool val) {
+    ui->action_Close_ROM       ->setEnabled(val);
+    ui->action_Open_ROM        ->setEnabled(val);
+    ui->action_Save_ROM        ->setEnabled(val);
+    ui->action_Save_ROM_As     ->setEnabled(val);
+    ui->action_Save_Patch      ->setEnabled(val);
 
     ui->action_Extra_Data_Patch->setEnabled(val && !leveldata_t::hasExtra);
 }
@@ -397,26 +436,44 @@ void MainWindow::openFile() {
 
             fileOpen = true;
 
-            for (uint i = 0; i < NUM_LEVELS; i++) {
-                levels[i] = loadLevel(rom, i);
-
-                // if the user aborted level load, give up and close the ROM
-                if (!levels[i]) {
+            // (everything is loaded from a read-only view of the ROM, which
+            //  doesn't depend on the file itself staying open)
+            romView = rom.view();
+            leveldata_t::hasExtra = hasExtraDataPatch(romView);
+
+            // use what was decoded the last time this ROM was opened, if possible
+            // (otherwise, save it all in the background for next time)
+            bool cached = projectCache.open(romView);
+            if (!cached)
+                buildProjectCache();
+
+            // rooms are only loaded when they're first needed, except for the
+            // overworlds (which map clear data depends on)
+            for (uint i = 0; i < 7; i++) {
+                QString error;
+
+                // if a level failed to load, give up and close the ROM
+                if (!getLevel(i, &error)) {
+                    QMessageBox::critical(this, tr("Load ROM"),
+                                          tr("%1\n\nThe ROM may be corrupt.").arg(error),
+                                          QMessageBox::Ok);
                     closeFile();
                     return;
                 }
             }
 
-            loadCHRBanks(rom);
-            loadTilesets(rom);
+            loadCHRBanks(romView);
+            if (!cached || !projectCache.loadGlobals()) {
+                loadTilesets(romView);
 
-            // get information about progressively revealing the overworld
-            for (uint i = 0; i < 7; i++)
-                loadMapClearData(rom, i, levels[i]->header.screensH);
+                // get information about progressively revealing the overworld
+                for (uint i = 0; i < 7; i++)
+                    loadMapClearData(romView, i, levels[i]->header.screensH, mapClearData[i]);
+            }
 
-            // see if the original extra map data table exists
-            // and get information from it, if necessary
-            readExtraData(rom, levels);
+            // reuse compressed data from the last time this ROM was saved, if possible
+            if (ui->action_Keep_Pack_Cache->isChecked())
+                packCache.load(fileName + ".kalecache");
 
             // show first level
             setLevel(0);
@@ -437,13 +494,41 @@ void MainWindow::openFile() {
 }
 
 void MainWindow::saveFile() {
-    if (!fileOpen || checkSaveLevel() == QMessageBox::Cancel)
+    saveChanges(QString());
+}
+
+/*
+  Saves all changes as an IPS or BPS patch instead of writing them to the ROM.
+*/
+void MainWindow::saveFileAsPatch() {
+    if (!fileOpen)
         return;
 
+    QString patchName = QFileDialog::getSaveFileName(this,
+                                 tr("Save Changes as Patch"),
+                                 QFileInfo(fileName).path() + "/" + QFileInfo(fileName).completeBaseName() + ".ips",
+                                 tr("IPS patches (*.ips);;BPS patches (*.bps)"));
+
+    if (!patchName.isNull())
+        saveChanges(patchName);
+}
+
+/*
+  Starts compressing and writing all level data back to the ROM in the background.
+  If a patch file name is given, the ROM itself is left alone and only the
+  differences between it and the new data are saved to the patch instead.
+  Everything being saved is copied first, so editing can continue while saving.
+*/
+void MainWindow::saveChanges(const QString& patchName) {
+    if (!fileOpen || saving || checkSaveLevel() == QMessageBox::Cancel)
+        return;
+
+    const QIODevice::OpenMode mode = patchName.isNull() ? QIODevice::ReadWrite : QIODevice::ReadOnly;
+
     // If there is a problem opening the original file for saving
     // (i.e. it was moved or deleted), let the user select a different one
     while (!QFile::exists(fileName)
-           || (QFile::exists(fileName) && !rom.openROM(QIODevice::ReadWrite))) {
+           || (QFile::exists(fileName) && !rom.openROM(mode))) {
         QMessageBox::critical(this, tr("Save File"),
                               tr("Unable to open\n%1\nfor saving. Please select a different ROM.")
                               .arg(fileName),
@@ -463,26 +548,28 @@ void MainWindow::saveFile() {
             rom.setFileName(fileName);
         }
     }
+    // (the save job opens the file again itself)
+    rom.close();
 
 #define save_done \
-    rom.close(); \
-    setEditActions(true); \
+    setSaveActions(true); \
     saving = false; \
     return
 // end macro
 
-    status(tr("Saving to file ") + fileName);
-
-    // disable saving/editing while already saving
-    setEditActions(false);
+    // disable saving while already saving
+    // (and changing levels, until they've all been loaded)
+    setSaveActions(false);
     saving = true;
 
-    std::list<DataChunk> chunks;
-    romaddr_t nextAddr = {0x00, 0x0A00};
-    const uint lastBank = 0x12;
     // calculated from amount of space between first door and the tile subtraction table
     const uint maxExits = 0x203;
 
+    // every room is about to be saved, so make sure they're all loaded
+    if (!loadAllLevels()) {
+        save_done;
+    }
+
     // check number of total exits and panic if there are too many
     uint numExits = 0;
     for (uint i = 0; i < NUM_LEVELS; i++) {
@@ -497,167 +584,140 @@ void MainWindow::saveFile() {
         save_done;
     }
 
-    // 0x12 banks available, first one has the first 0xA00 bytes used by palettes)
-    const uint freeSpace = (BANK_SIZE * lastBank) - nextAddr.addr;
-
-    // keep track of the amount of free space left
-    uint usedSpace = 0;
-    uint usedBanks = 0;
-    uint bankSpace = BANK_SIZE - 0x0A00;
-    uint chunkSize;
-
-#define update_size \
-    chunkSize = chunks.back().size; \
-    usedSpace += chunkSize; \
-    if (chunkSize > bankSpace) { \
-        usedBanks++; \
-        bankSpace = BANK_SIZE; \
-    } \
-    bankSpace -= chunkSize
-// end macro
+#undef save_done
 
-    // pack level and sprite data
-    for (uint i = 0; i < NUM_LEVELS; i++) {
-        chunks.push_back(packLevel(levels[i], i));
-        update_size;
+    status(tr("Saving to file ") + fileName);
 
-        chunks.push_back(packSprites(levels[i], i));
-        update_size;
+    saveJob = new SaveJob(fileName, patchName, savePackMode(), packCache,
+                          ui->action_Keep_Pack_Cache->isChecked() ? fileName + ".kalecache" : QString());
 
-        QCoreApplication::processEvents();
+    // copy everything that's about to be saved
+    // (levels only share their data with the editor's copies until one of them changes)
+    saveData_t& data = saveJob->data;
+    for (uint i = 0; i < NUM_LEVELS; i++) {
+        data.levels.push_back(*levels[i]);
     }
-    // pack tilesets
-    for (uint i = 0; i < NUM_TILESETS; i++) {
-        chunks.push_back(packTileset(i));
-        update_size;
-
-        QCoreApplication::processEvents();
+    data.hasExtra = leveldata_t::hasExtra;
+    memcpy(data.tilesets,     tilesets,     sizeof(data.tilesets));
+    memcpy(data.tileSubtract, tileSubtract, sizeof(data.tileSubtract));
+    memcpy(data.bankTable,    bankTable,    sizeof(data.bankTable));
+    memcpy(data.palettes,     palettes,     sizeof(data.palettes));
+    memcpy(data.sprPalettes,  sprPalettes,  sizeof(data.sprPalettes));
+    for (uint map = 0; map < 7; map++) {
+        for (uint level = 0; level < 16; level++)
+            data.mapClearData[map][level] = mapClearData[map][level];
     }
-    // dummy-ish entry representing all three CHR bank tables consecutively
-    // (they must be stored in the same PRG bank, and the uncompressed data is already
-    //  stored elsewhere)
-    chunks.push_back(DataChunk(NULL, 0x300, DataChunk::banks, 0));
-    update_size;
 
-#undef update_size
+    // the job keeps its own copy of the pack cache, which is merged back into this one
+    // when it's done (so anything added to this one in the meantime isn't lost)
+    packCache.clear();
 
-    // panic if there's too much space
-    if (usedSpace > freeSpace) {
-        QMessageBox::critical(this, tr("Error saving file"),
-                              tr("Not enough free space in ROM (%1 bytes available, %2 bytes used).")
-                              .arg(freeSpace).arg(usedSpace),
-                              QMessageBox::Ok);
+    QObject::connect(saveJob, SIGNAL(progress(int,int,QString)),
+                     this, SLOT(saveProgress(int,int,QString)));
 
-        save_done;
-    }
-    // or if some free space couldn't be used
-    else if (usedBanks >= lastBank) {
-        QMessageBox::critical(this, tr("Error saving file"),
-                              tr("Unable to save all level data because not all individual free space segments "
-                                 "would be large enough. Try reducing the size of some map or sprite data and "
-                                 "trying again."),
-                              QMessageBox::Ok);
+    // anything changed from now on will need to be saved again
+    if (patchName.isNull())
+        unsaved = false;
 
-        save_done;
-    }
+    saveProgressBar->setRange(0, 0);
+    saveProgressBar->show();
+    cancelSaveButton->setEnabled(true);
+    cancelSaveButton->show();
 
-    // sort packed chunks
-    chunks.sort();
+    SaveJob *job = saveJob;
+    saveWatcher.setFuture(QtConcurrent::run([job]() {
+        job->run();
+    }));
+}
 
-    // panic if something is bigger than it can/should be
-    if (chunks.back().size > BANK_SIZE) {
-        DataChunk& chunk = chunks.back();
+/*
+  Shows what a save running in the background is currently doing.
+*/
+void MainWindow::saveProgress(int value, int maximum, const QString& text) {
+    if (!saveJob)
+        return;
 
-        QMessageBox::critical(this, tr("Error saving file"),
-                              tr("Something exceeded 0x2000 bytes somehow (type %1, num %2, size %3).")
-                              .arg(chunk.type).arg(chunk.num).arg(chunk.size),
-                              QMessageBox::Ok);
+    saveProgressBar->setRange(0, maximum);
+    saveProgressBar->setValue(value);
+    status(text);
+}
 
-        save_done;
-    }
+/*
+  Stops a save running in the background (without changing the file.)
+*/
+void MainWindow::cancelSave() {
+    if (!saveJob)
+        return;
 
-    // finally
-
-    while (chunks.size()) {
-        // find biggest chunk that will fit in the current ROM bank
-        uint space = BANK_SIZE - (nextAddr.addr % BANK_SIZE);
-
-        for (std::list<DataChunk>::reverse_iterator i = chunks.rbegin(); i != chunks.rend(); i++) {
-            if (space >= i->size) {
-                DataChunk& chunk = *i;
-
-                switch (chunk.type) {
-                case DataChunk::level:
-                    // save level data
-                    saveLevel(rom, chunk, levels[chunk.num], nextAddr);
-                    break;
-                case DataChunk::enemy:
-                    // save enemy/sprite data
-                    saveSprites(rom, chunk, nextAddr);
-                    break;
-                case DataChunk::tileset:
-                    // save tileset data
-                    saveTileset(rom, chunk, nextAddr);
-                    break;
-                case DataChunk::banks:
-                    saveBankTables(rom, nextAddr);
-                    break;
-                }
+    saveJob->cancel();
+    cancelSaveButton->setEnabled(false);
+    status(tr("Cancelling save..."));
+}
 
-                nextAddr.addr += chunk.size;
-                // will the smallest available next chunk still fit in this bank?
-                if (space < chunk.size + chunks.front().size) {
-                    nextAddr.bank++;
-                    nextAddr.addr = 0;
-                }
+/*
+  Shows the results of a save once the background job is done.
+*/
+void MainWindow::saveFinished() {
+    if (!saveJob)
+        return;
 
-                chunks.erase((++i).base());
-                break;
-            }
-        }
+    SaveJob *job = saveJob;
+    saveJob = NULL;
 
-        QCoreApplication::processEvents();
-    }
+    saveProgressBar->hide();
+    cancelSaveButton->hide();
 
-    // save all level exits (in level order instead of by size so pointers can be
-    // calculated correctly)
-    for (uint i = 0; i < NUM_LEVELS; i++) {
-        saveExits(rom, levels[i], i);
-    }
+    // keep whatever was compressed for next time (even if the save didn't finish)
+    packCache.merge(job->packCache);
 
-    // save map clear data for overworlds
-    for (uint i = 0; i < 7; i++) {
-        saveMapClearData(rom, levels[i], i);
-    }
+    if (job->result == SaveJob::saved) {
+        if (!job->patchName.isNull()) {
+            status(tr("Saved %1 (%n byte(s) changed)", 0, job->changed).arg(job->patchName));
+        } else {
+            // keep what's been saved for the next time this ROM is opened
+            romView = job->savedROM;
+            projectCache.close();
+            if (job->changed)
+                buildProjectCache();
+
+            status(tr("Saved %1 (%n byte(s) changed, slowest room to decompress: %2, estimated ~%3 frames)", 0, job->changed)
+                   .arg(job->fileName).arg(hexFormat(job->slowestRoom, 3))
+                   .arg(job->slowestCycles / (double)NES_CYCLES_PER_FRAME, 0, 'f', 2));
+        }
 
-    // save palettes
-    savePalettes(rom);
-
-    // terrible hack to fix a likely off-by-one error in the game itself which causes
-    // screen 15 to always have no collision. i'm doing this in a very hacky way right
-    // now and i hope to be able to move this into something nicer if i ever end up
-    // having to make more behind-the-scenes code changes, like the switch location fix
-    // which there isn't enough free ROM space to cleanly insert :(
-    // fixes issue #6 (and doesn't break anything else, i hope)
-    const romaddr_t screenCollisionMax[] = {
-        {0x3f, 0xf75d}, // most versions
-        {0x3f, 0xf77a}, // canada
-        {0x3f, 0xf777}  // japan
-    };
-    for (uint i = 0; i < 3; i++) {
-        if (rom.readByte(screenCollisionMax[i]) == 0x74) {
-            rom.writeByte(screenCollisionMax[i], 0x75);
-            break;
+    } else {
+        if (job->result == SaveJob::cancelled) {
+            status(tr("Save cancelled."));
+        } else {
+            status(tr("Unable to save %1.").arg(job->fileName));
+            QMessageBox::critical(this, job->patchName.isNull() ? tr("Error saving file")
+                                                                : tr("Error saving patch"),
+                                  job->error,
+                                  QMessageBox::Ok);
         }
-    }
 
-    status(tr("Saved %1").arg(fileName));
+        // nothing was saved after all
+        if (job->patchName.isNull())
+            unsaved = true;
+    }
 
-    unsaved = false;
+    delete job;
 
-    save_done;
+    setSaveActions(true);
+    saving = false;
+}
 
-#undef save_done
+/*
+  Waits for work running on the thread pool to finish while keeping the UI responsive.
+*/
+void MainWindow::waitFor(const QFuture<void>& future) {
+    QFutureWatcher<void> watcher;
+    QEventLoop loop;
+    QObject::connect(&watcher, SIGNAL(finished()),
+                     &loop, SLOT(quit()));
+    watcher.setFuture(future);
+    if (!future.isFinished())
+        loop.exec();
 }
 
 void MainWindow::saveFileAs() {
@@ -700,12 +760,17 @@ int MainWindow::closeFile() {
         return -1;
 
     // deallocate all level data
+    finishPrefetch();
+    decodeTimeWatcher.waitForFinished();
     for (uint i = 0; i < NUM_LEVELS; i++) {
         delete levels[i];
         levels[i] = NULL;
     }
 
     freeCHRBanks();
+    packCache.clear();
+    projectCache.close();
+    romView = ROMView();
 
     // clear level displays
     currentLevel.header.screensH = 0;
@@ -811,7 +876,22 @@ void MainWindow::applyExtraDataPatch() {
     int version = getGameVersion();
 
     if (version > -1 && version < extraDataPatches.size()) {
-        leveldata_t::hasExtra |= applyPatch(this->rom, extraDataPatches[version]);
+        // every room has to be loaded from the unpatched ROM first, since the patch
+        // replaces the table that any rooms not loaded yet would get their extra info from
+        if (!loadAllLevels())
+            return;
+
+        if (applyPatch(this->rom, extraDataPatches[version])) {
+            leveldata_t::hasExtra = true;
+
+            // anything decoded from the ROM before the patch is out of date now
+            romView = rom.view();
+            projectCache.close();
+            buildProjectCache();
+
+            // (each room's extra info is only moved into its map data when it's saved)
+            setUnsaved();
+        }
         ui->action_Extra_Data_Patch->setDisabled(leveldata_t::hasExtra);
     }
 }
@@ -839,32 +919,24 @@ void MainWindow::showAbout()  {
 */
 
 void MainWindow::setLevel(uint level) {
-    if (level > NUM_LEVELS || !fileOpen)
+    // (levels can't be changed while they're being loaded for saving)
+    if (level >= NUM_LEVELS || !fileOpen || (saving && !saveJob))
         return;
 
     // save changes to the level?
     if (checkSaveLevel() == QMessageBox::Cancel) return;
 
-    this->level = level;
-    currentLevel = *(levels[level]);
-
-    // make deep copies of sprite and exit stuff
-    currentLevel.exits.clear();
-    currentLevel.sprites.clear();
-    for (std::list<exit_t*>::const_iterator i = levels[level]->exits.begin();
-         i != levels[level]->exits.end(); i++) {
-
-        exit_t *exit = new exit_t;
-        *exit = *(*i);
-        currentLevel.exits.push_back(exit);
+    QString error;
+    if (!getLevel(level, &error)) {
+        QMessageBox::critical(this, tr("Load Room"),
+                              tr("%1\n\nThe ROM may be corrupt.").arg(error),
+                              QMessageBox::Ok);
+        return;
     }
-    for (std::list<sprite_t*>::const_iterator i = levels[level]->sprites.begin();
-         i != levels[level]->sprites.end(); i++) {
 
-        sprite_t *sprite = new sprite_t;
-        *sprite = *(*i);
-        currentLevel.sprites.push_back(sprite);
-    }
+    // (this is cheap, since both copies share everything until one of them is changed)
+    this->level = level;
+    currentLevel = *(levels[level]);
 
     // update button enabled states
     setLevelChangeActions(true);
@@ -879,6 +951,207 @@ void MainWindow::setLevel(uint level) {
     // display the room number in the toolbar label
     levelLabel->setText(QString("  Room ")
                         + hexFormat(level, 3));
+
+    showDecodeTime();
+    prefetchLevels(level);
+}
+
+/*
+  Returns a level, loading it from the ROM first if it hasn't been used yet.
+  Returns null if the level couldn't be loaded, along with the reason through
+  "error" (if given).
+*/
+leveldata_t* MainWindow::getLevel(uint num, QString *error) {
+    if (num >= NUM_LEVELS)
+        return NULL;
+    if (levels[num])
+        return levels[num];
+
+    // if the level is already being loaded in the background, just wait for that
+    QHash<uint, QFuture<leveldata_t*> >::iterator i = prefetching.find(num);
+    if (i != prefetching.end()) {
+        levels[num] = i->result();
+        prefetching.erase(i);
+    } else {
+        levels[num] = projectCache.loadLevel(num);
+    }
+    // (if that failed, try again here to find out why)
+    if (!levels[num])
+        levels[num] = loadLevel(romView, num, error);
+
+    return levels[num];
+}
+
+/*
+  Starts loading the levels most likely to be used after this one in the background
+  (the ones the current level has exits to, and the ones right before and after it.)
+*/
+void MainWindow::prefetchLevels(uint num) {
+    // keep anything that has already finished loading
+    QHash<uint, QFuture<leveldata_t*> >::iterator i = prefetching.begin();
+    while (i != prefetching.end()) {
+        if (i->isFinished()) {
+            levels[i.key()] = i->result();
+            i = prefetching.erase(i);
+        } else {
+            i++;
+        }
+    }
+
+    std::vector<uint> nums;
+    if (num > 0)
+        nums.push_back(num - 1);
+    nums.push_back(num + 1);
+    for (ObjectList<exit_t>::const_iterator j = levels[num]->exits.begin();
+         j != levels[num]->exits.end(); j++) {
+        nums.push_back(j->dest);
+    }
+
+    ROMView view = romView;
+    const ProjectCache *cache = &projectCache;
+    for (std::vector<uint>::const_iterator j = nums.begin(); j != nums.end(); j++) {
+        if (*j >= NUM_LEVELS || levels[*j] || prefetching.contains(*j))
+            continue;
+
+        uint next = *j;
+        prefetching.insert(next, QtConcurrent::run([view, cache, next]() {
+            leveldata_t *level = cache->loadLevel(next);
+            return level ? level : loadLevel(view, next);
+        }));
+    }
+}
+
+/*
+  Waits for all levels being loaded in the background to finish loading.
+*/
+void MainWindow::finishPrefetch() {
+    for (QHash<uint, QFuture<leveldata_t*> >::iterator i = prefetching.begin();
+         i != prefetching.end(); i++) {
+        leveldata_t *level = i->result();
+        if (levels[i.key()])
+            delete level;
+        else
+            levels[i.key()] = level;
+    }
+    prefetching.clear();
+}
+
+/*
+  Saves everything decoded from the current ROM to the project cache in the background.
+*/
+void MainWindow::buildProjectCache() {
+    ROMView view = romView;
+    QtConcurrent::run([view]() {
+        ProjectCache::build(view);
+    });
+}
+
+/*
+  Loads every level that hasn't been loaded yet (i.e. before saving the whole ROM)
+  using a thread pool, then reports any problems after they're all done.
+  Returns false if any of them couldn't be loaded.
+*/
+bool MainWindow::loadAllLevels() {
+    finishPrefetch();
+
+    std::vector<uint> nums;
+    std::vector<QString> errors(NUM_LEVELS);
+    for (uint i = 0; i < NUM_LEVELS; i++) {
+        if (!levels[i])
+            nums.push_back(i);
+    }
+    if (nums.empty())
+        return true;
+
+    ROMView view = romView;
+    waitFor(QtConcurrent::map(nums, [this, &view, &errors](uint num) {
+        levels[num] = projectCache.loadLevel(num);
+        if (!levels[num])
+            levels[num] = loadLevel(view, num, &errors[num]);
+    }));
+
+    QStringList failed;
+    for (std::vector<uint>::const_iterator i = nums.begin(); i != nums.end(); i++) {
+        if (!levels[*i])
+            failed.append(errors[*i]);
+    }
+
+    if (!failed.isEmpty()) {
+        if (failed.size() > 10) {
+            int more = failed.size() - 10;
+            failed = failed.mid(0, 10);
+            failed.append(tr("(and %n more)", 0, more));
+        }
+
+        QMessageBox::critical(this, tr("Load ROM"),
+                              tr("Unable to load some rooms. The ROM may be corrupt.\n\n%1")
+                              .arg(failed.join("\n")),
+                              QMessageBox::Ok);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+  Returns the compression mode to use when saving (before trying optimal compression)
+*/
+int MainWindow::savePackMode() const {
+    return ui->action_Fast_Decode->isChecked() ? PACK_FAST_DECODE : PACK_NORMAL;
+}
+
+/*
+  Shows the size of the current room's compressed map data and
+  a rough estimate of how long the game will take to decompress it
+  (if it isn't in the pack cache already, it's compressed in the background first.)
+*/
+void MainWindow::showDecodeTime() {
+    const int  mode     = savePackMode();
+    const bool hasExtra = leveldata_t::hasExtra;
+    DataChunk chunk = packLevel(levels[level], level, hasExtra);
+
+    QByteArray key = ChunkCache::key(chunk, mode);
+    if (packCache.get(key, chunk)) {
+        showDecodeTime(level, chunk.size, unpack_cycles(chunk.data.data(), chunk.size));
+        return;
+    }
+
+    // (the copy shares everything with the editor's copy, so it's safe to use from the pool)
+    const leveldata_t levelData = *levels[level];
+    const uint num = level;
+    decodeTimeWatcher.setFuture(QtConcurrent::run([levelData, num, hasExtra, mode, key]() {
+        DataChunk chunk = packLevel(&levelData, num, hasExtra);
+        chunk.pack(mode);
+
+        decodeTime_t result;
+        result.num    = num;
+        result.cycles = unpack_cycles(chunk.data.data(), chunk.size);
+        result.key    = key;
+        result.packed = QByteArray((const char*)chunk.data.data(), chunk.size);
+        return result;
+    }));
+}
+
+void MainWindow::showDecodeTime(uint num, uint size, uint cycles) {
+    status(tr("Room %1: %2 bytes compressed, estimated decompression cost ~%3 cycles (~%4 frames).")
+           .arg(hexFormat(num, 3)).arg(size).arg(cycles)
+           .arg(cycles / (double)NES_CYCLES_PER_FRAME, 0, 'f', 2));
+}
+
+/*
+  Keeps a room's map data compressed in the background for later,
+  and shows roughly how long it takes to decompress (if that room is still open.)
+*/
+void MainWindow::decodeTimeFinished() {
+    if (!fileOpen)
+        return;
+
+    const decodeTime_t result = decodeTimeWatcher.result();
+    DataChunk chunk(result.packed.constData(), result.packed.size(), DataChunk::level, result.num);
+    packCache.put(result.key, chunk);
+
+    if (result.num == level)
+        showDecodeTime(result.num, chunk.size, result.cycles);
 }
 
 void MainWindow::saveCurrentLevel() {
@@ -891,48 +1164,24 @@ void MainWindow::saveCurrentLevel() {
 
     leveldata_t *thisLevel = levels[level];
 
-    // delete old level's sprites & exits
-    for (std::list<exit_t*>::const_iterator i = thisLevel->exits.begin();
-         i != thisLevel->exits.end(); i++) {
-
-        delete *i;
-    }
-    for (std::list<sprite_t*>::const_iterator i = thisLevel->sprites.begin();
-         i != thisLevel->sprites.end(); i++) {
-
-        delete *i;
-    }
-
+    // (both copies share everything until one of them is changed again)
     *thisLevel = currentLevel;
 
-    // deep copy new sprites and exits
-    thisLevel->exits.clear();
-    thisLevel->sprites.clear();
-    for (std::list<exit_t*>::const_iterator i = currentLevel.exits.begin();
+    // only include sprites and exits which are actually within the bounds of the level
+    // (any others would get invalid coordinates)
+    for (ObjectList<exit_t>::const_iterator i = currentLevel.exits.begin();
          i != currentLevel.exits.end(); i++) {
 
-        // only include exits which are actually within the bounds of the level
-        // (any others would get invalid coordinates)
-        if ((*i)->x >= currentLevel.header.screensH * SCREEN_WIDTH
-            || (*i)->y >= currentLevel.header.screensV * SCREEN_HEIGHT)
-            continue;
-
-        exit_t *exit = new exit_t;
-        *exit = *(*i);
-        thisLevel->exits.push_back(exit);
+        if (i->x >= currentLevel.header.screensH * SCREEN_WIDTH
+            || i->y >= currentLevel.header.screensV * SCREEN_HEIGHT)
+            thisLevel->exits.remove(i->id);
     }
-    for (std::list<sprite_t*>::const_iterator i = currentLevel.sprites.begin();
+    for (ObjectList<sprite_t>::const_iterator i = currentLevel.sprites.begin();
          i != currentLevel.sprites.end(); i++) {
 
-        // only include sprites which are actually within the bounds of the level
-        // (any others would get invalid coordinates)
-        if ((*i)->x >= currentLevel.header.screensH * SCREEN_WIDTH
-            || (*i)->y >= currentLevel.header.screensV * SCREEN_HEIGHT)
-            continue;
-
-        sprite_t *sprite = new sprite_t;
-        *sprite = *(*i);
-        thisLevel->sprites.push_back(sprite);
+        if (i->x >= currentLevel.header.screensH * SCREEN_WIDTH
+            || i->y >= currentLevel.header.screensV * SCREEN_HEIGHT)
+            thisLevel->sprites.remove(i->id);
     }
 
     status(tr("Room saved."));
@@ -987,6 +1236,12 @@ QMessageBox::StandardButton MainWindow::checkSaveROM() {
     // yes = save current level to group of all levels
     if (button == QMessageBox::Yes) {
         saveFile();
+
+        // don't close anything until the save is done
+        if (saveJob) {
+            waitFor(saveWatcher.future());
+            saveFinished();
+        }
     }
 
     return button;
@@ -11,7 +11,12 @@
 #include <QtWidgets/QMessageBox>
 #include <QtWidgets/QLabel>
 #include <QtWidgets/QActionGroup>
+#include <QtWidgets/QProgressBar>
+#include <QtWidgets/QPushButton>
 #include <QSettings>
+#include <QFuture>
+#include <QFutureWatcher>
+#include <QHash>
 
 #include "romfile.h"
 #include "mapscene.h"
@@ -20,11 +25,24 @@
 #include "mapcleareditwindow.h"
 #include "tileseteditwindow.h"
 #include "paletteeditwindow.h"
+#include "chunkcache.h"
+#include "projectcache.h"
+#include "savejob.h"
 
 namespace Ui {
 class MainWindow;
 }
 
+/*
+  A room's map data, compressed in the background to see how long it takes to decompress.
+*/
+struct decodeTime_t {
+    uint       num;
+    uint       cycles;
+    QByteArray key;
+    QByteArray packed;
+};
+
 class MainWindow : public QMainWindow
 {
     Q_OBJECT
@@ -38,10 +56,18 @@ protected slots:
     void openFile();
     void saveFile();
     void saveFileAs();
+    void saveFileAsPatch();
     int  closeFile();
 
     void setUnsaved();
 
+    // saving in the background
+    void saveProgress(int value, int maximum, const QString& text);
+    void saveFinished();
+    void cancelSave();
+
+    void decodeTimeFinished();
+
     // level menu
     void loadCourseFromFile();
     void saveCourseToFile();
@@ -77,6 +103,7 @@ protected slots:
     // toolbar updates
     void setOpenFileActions(bool val);
     void setEditActions(bool val);
+    void setSaveActions(bool val);
     void setUndoRedoActions(bool val = true);
     void setLevelChangeActions(bool val);
 
@@ -87,6 +114,8 @@ private:
     Ui::MainWindow *ui;
     QLabel *levelLabel;
     QActionGroup *selectGroup;
+    QProgressBar *saveProgressBar;
+    QPushButton  *cancelSaveButton;
 
     QSettings *settings;
 
@@ -95,9 +124,23 @@ private:
     ROMFile rom;
     bool    fileOpen, unsaved, saving;
 
+    // save running in the background (if any)
+    SaveJob               *saveJob;
+    QFutureWatcher<void>  saveWatcher;
+
+    // previously compressed level/tileset data
+    ChunkCache packCache;
+    // previously decoded data for the current ROM
+    ProjectCache projectCache;
+
     // The level data
+    // (levels are loaded from projectCache or romView when they're first used, and
+    //  the ones likely to be used next are loaded in the background)
     uint         level;
+    ROMView      romView;
     leveldata_t* levels[NUM_LEVELS];
+    QHash<uint, QFuture<leveldata_t*> > prefetching;
+    QFutureWatcher<decodeTime_t>        decodeTimeWatcher;
     leveldata_t  currentLevel;
 
     // renderin stuff
@@ -114,6 +157,16 @@ private:
     void saveSettings();
     void updateTitle();
     void setLevel(uint);
+    leveldata_t* getLevel(uint num, QString *error = 0);
+    void prefetchLevels(uint num);
+    void finishPrefetch();
+    void buildProjectCache();
+    bool loadAllLevels();
+    void saveChanges(const QString& patchName);
+    void waitFor(const QFuture<void>& future);
+    int  savePackMode() const;
+    void showDecodeTime();
+    void showDecodeTime(uint num, uint size, uint cycles);
     QMessageBox::StandardButton checkSaveLevel();
     QMessageBox::StandardButton checkSaveROM();
 };
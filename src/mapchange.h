@@ -33,8 +33,7 @@ private:
 class SpriteChange : public QUndoCommand
 {
 public:
-    explicit SpriteChange(SpriteItem *item, sprite_t *sprite,
-                          sprite_t before,
+    explicit SpriteChange(SpriteItem *item, sprite_t before,
                           QUndoCommand *parent = 0);
 
     void undo();
@@ -42,15 +41,13 @@ public:
 
 private:
     SpriteItem *item;
-    sprite_t *sprite;
     sprite_t before, after;
 };
 
 class ExitChange : public QUndoCommand
 {
 public:
-    explicit ExitChange(ExitItem *item, exit_t *exit,
-                        exit_t before,
+    explicit ExitChange(ExitItem *item, exit_t before,
                         QUndoCommand *parent = 0);
 
     void undo();
@@ -58,7 +55,6 @@ public:
 
 private:
     ExitItem *item;
-    exit_t *exit;
     exit_t before, after;
 };
 
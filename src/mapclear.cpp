@@ -12,13 +12,15 @@ const romaddr_t ptrMapClearH  = {0x12, 0x9CEE};
 const uint      ptrMapClearB  = 0x12;
 const romaddr_t mapClearStart = {0x12, 0x9D5E};
 
-void loadMapClearData(ROMFile& rom, uint map, uint width) {
+// (for ROMFile::pointerTable or ROMView::pointerTable)
+#define MAP_CLEAR_POINTERS ptrMapClearL, ptrMapClearH, ptrMapClearB, 7 * 16
+
+void loadMapClearData(const ROMView& rom, uint map, uint width, std::vector<QRect> *rects) {
     for (uint level = 0; level < 16; level++) {
-        mapClearData[map][level].clear();
+        rects[level].clear();
 
         uint8_t bytes[4] = {0};
-        romaddr_t addr = rom.readShortPointer(ptrMapClearL, ptrMapClearH, ptrMapClearB,
-                                              (map * 16) + level);
+        romaddr_t addr = rom.pointerTable(MAP_CLEAR_POINTERS)[(map * 16) + level];
         if (!addr.addr) continue;
 
         do {
@@ -27,43 +29,43 @@ void loadMapClearData(ROMFile& rom, uint map, uint width) {
             addr.addr += 4;
 
             uint screen = bytes[0] & 0xF;
-            uint x = (screen % width * SCREEN_WIDTH) + (bytes[1] & 0xF);
-            uint y = (screen / width * SCREEN_HEIGHT) + (bytes[1] >> 4);
+            uint x = screenLeft(screen, width) + (bytes[1] & 0xF);
+            uint y = screenTop(screen, width) + (bytes[1] >> 4);
 
-            mapClearData[map][level].push_back(QRect(x, y, bytes[2], bytes[3]));
+            rects[level].push_back(QRect(x, y, bytes[2], bytes[3]));
 
         } while (bytes[0] < 0x80);
     }
 }
 
 
-void saveMapClearData(ROMFile& rom, const leveldata_t *levelData, uint num) {
+void saveMapClearData(ROMFile& rom, const leveldata_t *levelData, uint num,
+                      const std::vector<QRect> (*clearData)[16]) {
 
     romaddr_t addr = mapClearStart;
     // get address to write clear data to based on how many rects were written
     // for previous levels
     for (uint map = 0; map < num; map++)
         for (uint level = 0; level < 0x10; level++)
-            addr.addr += 4 * mapClearData[map][level].size();
+            addr.addr += 4 * clearData[map][level].size();
 
 
     for (uint level = 0; level < 0x10; level++) {
-        std::vector<QRect>& rects = mapClearData[num][level];
+        const std::vector<QRect>& rects = clearData[num][level];
 
         if (!rects.size()) {
-            rom.writeToShortPointer(ptrMapClearL, ptrMapClearH, {0, 0}, 0, NULL, num * 16 + level);
+            rom.pointerTable(MAP_CLEAR_POINTERS).set(num * 16 + level, {0, 0});
             continue;
         }
 
-        rom.writeToShortPointer(ptrMapClearL, ptrMapClearH, addr, 0, NULL, num * 16 + level);
+        rom.pointerTable(MAP_CLEAR_POINTERS).set(num * 16 + level, addr);
 
         uint numRects = rects.size();
         for (std::vector<QRect>::const_iterator i = rects.begin(); i != rects.end(); i++) {
             uint8_t bytes[4];
 
             // byte 0: screen
-            bytes[0] = (i->y() / SCREEN_HEIGHT * levelData->header.screensH)
-                     + (i->x() / SCREEN_WIDTH);
+            bytes[0] = screenNum(i->x(), i->y(), levelData->header.screensH);
             // and last rect flag
             if (--numRects == 0)
                 bytes[0] |= 0x80;
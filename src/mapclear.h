@@ -12,8 +12,8 @@
 
 extern std::vector<QRect> mapClearData[7][16];
 
-void loadMapClearData(ROMFile&, uint, uint);
-void saveMapClearData(ROMFile&, const leveldata_t*, uint);
+void loadMapClearData(const ROMView&, uint, uint, std::vector<QRect>*);
+void saveMapClearData(ROMFile&, const leveldata_t*, uint, const std::vector<QRect> (*)[16]);
 
 class MapClearDelegate : public QItemDelegate {
     Q_OBJECT
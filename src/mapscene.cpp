@@ -119,8 +119,8 @@ void MapScene::refresh() {
     refreshPixmap();
 
     // add sprites
-    for (std::list<sprite_t*>::iterator i = level->sprites.begin(); i != level->sprites.end(); i++) {
-        SpriteItem *spr = new SpriteItem(*i);
+    for (ObjectList<sprite_t>::const_iterator i = level->sprites.begin(); i != level->sprites.end(); i++) {
+        SpriteItem *spr = new SpriteItem(level, i->id);
         spr->setFlag(QGraphicsItem::ItemIsSelectable, selectSprites);
         spr->setFlag(QGraphicsItem::ItemIsMovable, selectSprites);
         addItem(spr);
@@ -128,8 +128,8 @@ void MapScene::refresh() {
     }
 
     // add exits
-    for (std::list<exit_t*>::iterator i = level->exits.begin(); i != level->exits.end(); i++) {
-        ExitItem *exit = new ExitItem(*i);
+    for (ObjectList<exit_t>::const_iterator i = level->exits.begin(); i != level->exits.end(); i++) {
+        ExitItem *exit = new ExitItem(level, i->id);
         exit->setFlag(QGraphicsItem::ItemIsSelectable, selectExits);
         exit->setFlag(QGraphicsItem::ItemIsMovable, selectExits);
         addItem(exit);
@@ -231,18 +231,18 @@ void MapScene::mousePressEvent(QGraphicsSceneMouseEvent *event) {
             cancelSelection();
             event->accept();
         } else if (selectSprites) {
-            sprite_t* sprite = new sprite_t();
-            sprite->x = tileX; sprite->y = tileY;
-            level->sprites.push_back(sprite);
+            sprite_t sprite = sprite_t();
+            sprite.x = tileX; sprite.y = tileY;
+            level->sprites.add(sprite);
             // TODO: simpler scene item refresh
             level->modified = true;
             emit edited();
             refresh();
             event->accept();
         } else if (selectExits) {
-            exit_t* exit = new exit_t();
-            exit->x = tileX; exit->y = tileY;
-            level->exits.push_back(exit);
+            exit_t exit = exit_t();
+            exit.x = tileX; exit.y = tileY;
+            level->exits.add(exit);
             // TODO: simpler scene item refresh
             level->modified = true;
             emit edited();
@@ -479,18 +479,16 @@ void MapScene::deleteItems() {
             SpriteItem *item = dynamic_cast<SpriteItem*>(*i);
 
             this->sprites.remove(item);
-            this->level->sprites.remove(item->sprite);
+            this->level->sprites.remove(item->id);
 
-            delete item->sprite;
             delete item;
 
         } else if (selectExits) {
             ExitItem *item = dynamic_cast<ExitItem*>(*i);
 
             this->exits.remove(item);
-            this->level->exits.remove(item->exit);
+            this->level->exits.remove(item->id);
 
-            delete item->exit;
             delete item;
         }
 
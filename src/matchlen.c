@@ -0,0 +1,222 @@
+/*
+	Match length kernels used by the exhal / inhal compression routines
+
+	This code is released under the terms of the MIT license.
+	See COPYING.txt for details.
+
+	Finding runs and back references spends nearly all of its time comparing long
+	strings of bytes, so this provides SSE2 and AVX2 versions of those comparisons
+	(chosen at runtime based on what the CPU supports) in addition to plain C ones.
+*/
+
+#include "matchlen.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MATCHLEN_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// lets the AVX2 kernels be built without enabling AVX2 for the whole program
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+// reverses the bits in each 4-bit value
+static const uint8_t rev4[16] = {
+	0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE,
+	0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF
+};
+
+static inline uint8_t rev8 (uint8_t i) {
+	return (rev4[i & 0xF] << 4) | rev4[i >> 4];
+}
+
+// index of the lowest set bit (mask is never 0)
+static inline uint32_t lowest_bit (uint32_t mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+/*
+	Plain C versions (also used for the last few bytes by the others)
+*/
+static uint32_t delta_scalar (const uint8_t *a, const uint8_t *b, uint8_t delta, uint32_t max) {
+	uint32_t i;
+	for (i = 0; i < max; i++)
+		if (a[i] != (uint8_t)(b[i] + delta)) break;
+	
+	return i;
+}
+
+static uint32_t rotated_scalar (const uint8_t *a, const uint8_t *b, uint32_t max) {
+	uint32_t i;
+	for (i = 0; i < max; i++)
+		if (a[i] != rev8(b[i])) break;
+	
+	return i;
+}
+
+static const matchlen_t kernels_scalar = {
+	delta_scalar, rotated_scalar, "scalar"
+};
+
+#ifdef MATCHLEN_X86
+
+/*
+	SSE2 versions (16 bytes at a time)
+*/
+TARGET_SSE2
+static uint32_t delta_sse2 (const uint8_t *a, const uint8_t *b, uint8_t delta, uint32_t max) {
+	const __m128i add = _mm_set1_epi8((char)delta);
+	uint32_t i;
+	
+	for (i = 0; i + 16 <= max; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i y = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(b + i)), add);
+		uint32_t diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+		if (diff)
+			return i + lowest_bit(diff);
+	}
+	
+	return i + delta_scalar(a + i, b + i, delta, max - i);
+}
+
+// no byte shuffles in SSE2, so reverse bits by swapping pairs, then nybbles' halves, then nybbles
+// (16-bit shifts are fine since the masks throw away anything shifted in from the next byte)
+TARGET_SSE2
+static inline __m128i rev8_sse2 (__m128i x) {
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0F);
+	
+	x = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 1), m1), _mm_slli_epi16(_mm_and_si128(x, m1), 1));
+	x = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 2), m2), _mm_slli_epi16(_mm_and_si128(x, m2), 2));
+	x = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 4), m4), _mm_slli_epi16(_mm_and_si128(x, m4), 4));
+	return x;
+}
+
+TARGET_SSE2
+static uint32_t rotated_sse2 (const uint8_t *a, const uint8_t *b, uint32_t max) {
+	uint32_t i;
+	
+	for (i = 0; i + 16 <= max; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i y = rev8_sse2(_mm_loadu_si128((const __m128i*)(b + i)));
+		uint32_t diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+		if (diff)
+			return i + lowest_bit(diff);
+	}
+	
+	return i + rotated_scalar(a + i, b + i, max - i);
+}
+
+static const matchlen_t kernels_sse2 = {
+	delta_sse2, rotated_sse2, "sse2"
+};
+
+/*
+	AVX2 versions (32 bytes at a time)
+*/
+TARGET_AVX2
+static uint32_t delta_avx2 (const uint8_t *a, const uint8_t *b, uint8_t delta, uint32_t max) {
+	const __m256i add = _mm256_set1_epi8((char)delta);
+	uint32_t i;
+	
+	for (i = 0; i + 32 <= max; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i y = _mm256_add_epi8(_mm256_loadu_si256((const __m256i*)(b + i)), add);
+		uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+		if (diff)
+			return i + lowest_bit(diff);
+	}
+	
+	return i + delta_scalar(a + i, b + i, delta, max - i);
+}
+
+// reverse bits by looking up each reversed nybble with a byte shuffle
+static const uint8_t rev4_high[16] = {
+	0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0,
+	0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0
+};
+
+TARGET_AVX2
+static inline __m256i rev8_avx2 (__m256i x) {
+	const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)rev4_high));
+	const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)rev4));
+	const __m256i m4 = _mm256_set1_epi8(0x0F);
+	
+	return _mm256_or_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, m4)),
+	                       _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(x, 4), m4)));
+}
+
+TARGET_AVX2
+static uint32_t rotated_avx2 (const uint8_t *a, const uint8_t *b, uint32_t max) {
+	uint32_t i;
+	
+	for (i = 0; i + 32 <= max; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i y = rev8_avx2(_mm256_loadu_si256((const __m256i*)(b + i)));
+		uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+		if (diff)
+			return i + lowest_bit(diff);
+	}
+	
+	return i + rotated_sse2(a + i, b + i, max - i);
+}
+
+static const matchlen_t kernels_avx2 = {
+	delta_avx2, rotated_avx2, "avx2"
+};
+
+// checks which instruction sets can actually be used
+static int cpu_level (void) {
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return MATCHLEN_AVX2;
+	if (__builtin_cpu_supports("sse2")) return MATCHLEN_SSE2;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxleaf = info[0];
+	
+	__cpuid(info, 1);
+	int sse2    = (info[3] >> 26) & 1;
+	int osxsave = (info[2] >> 27) & 1;
+	int avx     = (info[2] >> 28) & 1;
+	
+	if (maxleaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		if ((info[1] >> 5) & 1) return MATCHLEN_AVX2;
+	}
+	if (sse2) return MATCHLEN_SSE2;
+#endif
+	return MATCHLEN_SCALAR;
+}
+
+#endif // MATCHLEN_X86
+
+// Returns the fastest set of kernels supported by the current CPU, up to the given level.
+const matchlen_t* matchlen_kernels (int level) {
+#ifdef MATCHLEN_X86
+	int cpu = cpu_level();
+	if (level > cpu) level = cpu;
+	
+	if (level >= MATCHLEN_AVX2) return &kernels_avx2;
+	if (level >= MATCHLEN_SSE2) return &kernels_sse2;
+#else
+	(void)level;
+#endif
+	return &kernels_scalar;
+}
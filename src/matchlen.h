@@ -0,0 +1,43 @@
+/*
+	Match length kernels used by the exhal / inhal compression routines
+
+	This code is released under the terms of the MIT license.
+	See COPYING.txt for details.
+*/
+
+#ifndef _MATCHLEN_H
+#define _MATCHLEN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// kernel sets for matchlen_kernels()
+#define MATCHLEN_SCALAR 0
+#define MATCHLEN_SSE2   1
+#define MATCHLEN_AVX2   2
+#define MATCHLEN_BEST   MATCHLEN_AVX2
+
+// functions which count how many bytes in a row (up to max) match between two buffers
+typedef struct {
+	// counts bytes where a[i] == (uint8_t)(b[i] + delta)
+	// (delta 0 is a normal comparison, delta 1 finds increasing sequences)
+	uint32_t (*delta)   (const uint8_t *a, const uint8_t *b, uint8_t delta, uint32_t max);
+	// counts bytes where a[i] is b[i] with its bits reversed
+	uint32_t (*rotated) (const uint8_t *a, const uint8_t *b, uint32_t max);
+	// name of this kernel set (for debug/benchmark output)
+	const char *name;
+} matchlen_t;
+
+// Returns the fastest set of kernels supported by the current CPU, up to the given level.
+// All kernel sets always return the same results.
+const matchlen_t* matchlen_kernels (int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+// end include guard
+#endif
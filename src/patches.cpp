@@ -1,6 +1,8 @@
 #include "patches.h"
 
 #include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
 #include <QDialog>
 #include <QVBoxLayout>
 #include <QComboBox>
@@ -9,9 +11,25 @@
 #include <QMessageBox>
 #include <QtEndian>
 
+#include <cstring>
+
 #define PATCH_PATH ":patches/"
 #define PATCH_EXTRA PATCH_PATH "maphacks-"
 
+// IPS records have 24-bit offsets and 16-bit sizes
+#define IPS_MAX_OFFSET 0xFFFFFF
+#define IPS_MAX_SIZE   0xFFFF
+// a record starting here would look like the end of the patch ("EOF")
+#define IPS_EOF        0x454F46
+
+// BPS patch actions
+enum {
+    bpsSourceRead,
+    bpsTargetRead,
+    bpsSourceCopy,
+    bpsTargetCopy
+};
+
 const QStringList extraDataPatches = {
     PATCH_EXTRA "us0.ips",
     PATCH_EXTRA "us1.ips",
@@ -51,6 +69,79 @@ int getGameVersion(QWidget *parent) {
     return -1;
 }
 
+/*
+  Applies an IPS patch to data in memory.
+  The whole patch is checked as it is applied to a copy of the data, so if the patch
+  is corrupt or meant for a bigger file, the original data is left alone and a
+  description of the problem is returned through "error" (if given).
+*/
+bool applyIPS(const QByteArray &patch, QByteArray &data, QString *error) {
+    QByteArray result = data;
+    const uchar *ptr = (const uchar*)patch.constData();
+    const uchar *end = ptr + patch.size();
+
+#define ips_error(msg) \
+    if (error) *error = msg; \
+    return false
+// end macro
+
+    if (patch.size() < 8 || memcmp(ptr, "PATCH", 5)) {
+        ips_error(QWidget::tr("The patch is not a valid IPS patch."));
+    }
+    ptr += 5;
+
+    while (true) {
+        if (end - ptr < 3) {
+            ips_error(QWidget::tr("The patch appears to be corrupt or incomplete."));
+        }
+        uint offset = (ptr[0] << 16) | qFromBigEndian<uint16_t>(ptr + 1);
+        ptr += 3;
+        if (offset == IPS_EOF) break;
+
+        if (end - ptr < 2) {
+            ips_error(QWidget::tr("The patch appears to be corrupt or incomplete."));
+        }
+        uint size = qFromBigEndian<uint16_t>(ptr);
+        ptr += 2;
+
+        if (!size) { // RLE patch entry
+            if (end - ptr < 3) {
+                ips_error(QWidget::tr("The patch appears to be corrupt or incomplete."));
+            }
+            size = qFromBigEndian<uint16_t>(ptr);
+            ptr += 2;
+            if (offset + size > (uint)result.size()) {
+                ips_error(QWidget::tr("The patch is meant for a larger file."));
+            }
+            memset(result.data() + offset, *ptr++, size);
+        } else {
+            if ((uint)(end - ptr) < size) {
+                ips_error(QWidget::tr("The patch appears to be corrupt or incomplete."));
+            }
+            if (offset + size > (uint)result.size()) {
+                ips_error(QWidget::tr("The patch is meant for a larger file."));
+            }
+            memcpy(result.data() + offset, ptr, size);
+            ptr += size;
+        }
+    }
+
+    // some patches also give a size to truncate the file to after the end marker
+    if (end - ptr == 3) {
+        uint size = (ptr[0] << 16) | qFromBigEndian<uint16_t>(ptr + 1);
+        if (size != (uint)result.size()) {
+            ips_error(QWidget::tr("The patch would change the size of the file."));
+        }
+    } else if (ptr != end) {
+        ips_error(QWidget::tr("The patch appears to be corrupt."));
+    }
+
+#undef ips_error
+
+    data = result;
+    return true;
+}
+
 bool applyPatch(ROMFile &file, QString path) {
     QFile patch(path);
     if (!patch.open(QIODevice::ReadOnly)) {
@@ -61,58 +152,316 @@ bool applyPatch(ROMFile &file, QString path) {
     }
     // ideally the target file should already be open (since the main window
     // will probably be made to handle any errors and allows the user to select
-    // a new file, leaving it open afterwards), but we'll handle it quickly here
-    // as well
-    if (!file.open(QIODevice::ReadWrite)) {
+    // a new file, leaving it open afterwards), in which case the patch is only
+    // applied to the ROM in memory and saved along with everything else.
+    // otherwise we'll open, patch and save it quickly here as well
+    bool wasOpen = file.isOpen();
+    if (!wasOpen && !file.openROM(QIODevice::ReadWrite)) {
         QMessageBox::critical(0, QWidget::tr("Error Applying Patch"),
                               QWidget::tr("Unable to open %1.").arg(file.fileName()),
                               QMessageBox::Ok);
         return false;
     }
 
-    patch.seek(5);
+    file.writePointerTables();
+    QByteArray data = file.getImage();
+    QString error;
+    bool ok = applyIPS(patch.readAll(), data, &error) && file.setImage(data);
+    if (!ok) {
+        QMessageBox::critical(0, QWidget::tr("Error Applying Patch"),
+                              QWidget::tr("Applying patch failed. %1").arg(error),
+                              QMessageBox::Ok);
+    } else if (!wasOpen && file.saveROM() < 0) {
+        QMessageBox::critical(0, QWidget::tr("Error Applying Patch"),
+                              QWidget::tr("Unable to write to %1.").arg(file.fileName()),
+                              QMessageBox::Ok);
+        ok = false;
+    } else {
+        QMessageBox::information(0, QWidget::tr("Apply Patch"),
+                              QWidget::tr("Patch applied successfully!"),
+                              QMessageBox::Ok);
+    }
+
+    patch.close();
+    if (!wasOpen)
+        file.close();
 
-    uchar buf[4] = {0};
-    uint32_t addr;
-    uint16_t size;
-    char rle;
-    while (true) {
-        buf[0] = 0;
-        if (patch.read((char*)buf+1, 3) < 0) goto error;
-        addr = qFromBigEndian<uint32_t>(buf);
-        if (addr == 0x454F46) break; // "EOF"
-        file.seek(addr);
+    return ok;
+}
 
-        if (patch.read((char*)buf, 2) < 0) goto error;
-        size = qFromBigEndian<uint16_t>(buf);
+/*
+  Applies one or more IPS patches to a file (for use from the command line).
+  All of the patches are applied in memory and the result is only saved once,
+  to the original file or to a different one.
+*/
+bool applyPatchesToFile(const QStringList &patches, QString inPath, QString outPath, QString *error) {
+    QFile in(inPath);
+    if (!in.open(QIODevice::ReadOnly)) {
+        if (error) *error = QWidget::tr("Unable to open %1.").arg(inPath);
+        return false;
+    }
+    QByteArray data = in.readAll();
+    in.close();
 
-        if (!size) { // RLE patch entry
-            if (patch.read((char*)buf, 2) < 0) goto error;
-            size = qFromBigEndian<uint16_t>(buf);
-            if (patch.read(&rle, 1) < 0) goto error;
+    for (QStringList::const_iterator i = patches.begin(); i != patches.end(); i++) {
+        QFile patch(*i);
+        if (!patch.open(QIODevice::ReadOnly)) {
+            if (error) *error = QWidget::tr("Unable to open %1.").arg(*i);
+            return false;
+        }
+
+        QString patchError;
+        if (!applyIPS(patch.readAll(), data, &patchError)) {
+            if (error) *error = QString("%1: %2").arg(*i).arg(patchError);
+            return false;
+        }
+    }
+
+    QSaveFile out(outPath.isEmpty() ? inPath : outPath);
+    if (!out.open(QIODevice::WriteOnly)
+            || out.write(data) != data.size()
+            || !out.commit()) {
+        if (error) *error = QWidget::tr("Unable to write to %1.").arg(out.fileName());
+        return false;
+    }
+
+    return true;
+}
+
+/*
+  Helper functions for creating patches
+*/
+static void appendBigEndian(QByteArray &patch, uint value, uint size) {
+    while (size--) {
+        patch.append((char)(value >> (size * 8)));
+    }
+}
+
+static void appendLittleEndian(QByteArray &patch, uint32_t value) {
+    for (uint i = 0; i < 4; i++) {
+        patch.append((char)(value >> (i * 8)));
+    }
+}
 
-            for (uint i = 0; i < size; i++) {
-                file.write(&rle, 1);
+static uint32_t crc32(const char *data, size_t size) {
+    static const struct crcTable_t {
+        uint32_t entry[256];
+
+        crcTable_t() {
+            for (uint i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (uint j = 0; j < 8; j++)
+                    crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+                entry[i] = crc;
             }
-        } else {
-            file.write(patch.read(size));
         }
+    } table;
+
+    uint32_t crc = 0xFFFFFFFF;
+    while (size--) {
+        crc = (crc >> 8) ^ table.entry[(crc ^ (uint8_t)*data++) & 0xFF];
     }
+    return ~crc;
+}
 
-    QMessageBox::information(0, QWidget::tr("Apply Patch"),
-                          QWidget::tr("Patch applied successfully!"),
-                          QMessageBox::Ok);
-    patch.close();
-    file.close();
+/*
+  Returns how many bytes starting at an offset are all the same value.
+*/
+static uint runLength(const QByteArray &data, uint offset, uint end) {
+    uint size = 1;
+    while (offset + size < end && data[offset + size] == data[offset])
+        size++;
+
+    return size;
+}
+
+/*
+  Adds normal IPS records for everything between two offsets, split into
+  as many records as needed.
+*/
+static bool ipsRecords(QByteArray &patch, const QByteArray &data, uint offset, uint end) {
+    while (offset < end) {
+        if (offset == IPS_EOF)
+            offset--;
+        if (offset > IPS_MAX_OFFSET)
+            return false;
+
+        uint size = qMin(end - offset, (uint)IPS_MAX_SIZE);
+        appendBigEndian(patch, offset, 3);
+        appendBigEndian(patch, size, 2);
+        patch.append(data.constData() + offset, size);
+        offset += size;
+    }
 
     return true;
+}
 
-error:
-    QMessageBox::critical(0, QWidget::tr("Error Applying Patch"),
-                          QWidget::tr("Applying patch failed. The patch appears to be corrupt."),
-                          QMessageBox::Ok);
-    patch.close();
-    file.close();
+/*
+  Creates an IPS patch which turns the original data into the modified data.
+  "changes" is the list of offsets and sizes of everything that differs between
+  the two (as returned by ROMFile::changedRanges).
+  Returns a null byte array if something couldn't be stored in an IPS patch
+  (i.e. the data is bigger than 16 MB).
+*/
+QByteArray createIPS(const QByteArray &modified, const QList<QPair<uint, uint> > &changes) {
+    QByteArray patch("PATCH");
+
+    // combine changes that are only a few bytes apart, since including the unchanged
+    // bytes in between takes up less space than the header of another record
+    QList<QPair<uint, uint> > ranges;
+    for (QList<QPair<uint, uint> >::const_iterator i = changes.begin(); i != changes.end(); i++) {
+        if (!ranges.isEmpty() && i->first - (ranges.back().first + ranges.back().second) < 5)
+            ranges.back().second = i->first + i->second - ranges.back().first;
+        else
+            ranges.append(*i);
+    }
+
+    for (QList<QPair<uint, uint> >::const_iterator i = ranges.begin(); i != ranges.end(); i++) {
+        uint start = i->first;
+        uint offset = start;
+        uint end = start + i->second;
+
+        while (offset < end) {
+            uint size = qMin(runLength(modified, offset, end), (uint)IPS_MAX_SIZE);
+
+            // an RLE record takes 8 bytes, and splitting a normal record around it
+            // takes another 5 bytes on either side
+            uint cost = 3;
+            if (offset > start)     cost += 5;
+            if (offset + size < end) cost += 5;
+
+            if (size > cost && offset != IPS_EOF && offset <= IPS_MAX_OFFSET) {
+                if (!ipsRecords(patch, modified, start, offset))
+                    return QByteArray();
+
+                appendBigEndian(patch, offset, 3);
+                appendBigEndian(patch, 0, 2);
+                appendBigEndian(patch, size, 2);
+                patch.append(modified[offset]);
+
+                offset += size;
+                start = offset;
+            } else {
+                offset += size;
+            }
+        }
+
+        if (!ipsRecords(patch, modified, start, end))
+            return QByteArray();
+    }
+
+    patch.append("EOF");
+    return patch;
+}
+
+static void bpsNumber(QByteArray &patch, uint64_t num) {
+    while (true) {
+        uint8_t x = num & 0x7F;
+        num >>= 7;
+        if (!num) {
+            patch.append((char)(0x80 | x));
+            break;
+        }
+        patch.append((char)x);
+        num--;
+    }
+}
+
+static void bpsAction(QByteArray &patch, uint action, uint size) {
+    bpsNumber(patch, ((uint64_t)(size - 1) << 2) | action);
+}
+
+/*
+  Creates a BPS patch which turns the original data into the modified data.
+  Unlike IPS, this has no size limit and includes checksums of the original data,
+  the modified data and the patch itself, so it can't be applied to the wrong ROM.
+*/
+QByteArray createBPS(const QByteArray &original, const QByteArray &modified,
+                     const QList<QPair<uint, uint> > &changes) {
+    QByteArray patch("BPS1");
+    bpsNumber(patch, original.size());
+    bpsNumber(patch, modified.size());
+    bpsNumber(patch, 0); // no metadata
+
+    uint offset = 0;
+    uint copyOffset = 0;
+    const uint sourceSize = original.size();
+    const uint targetSize = modified.size();
+
+    for (int i = 0; i <= changes.size(); i++) {
+        uint start = i < changes.size() ? changes[i].first : targetSize;
+        uint end   = i < changes.size() ? start + changes[i].second : targetSize;
+
+        // use the original data for everything that didn't change
+        // (unless the modified data is longer than the original)
+        uint unchanged = qMin(start, sourceSize);
+        if (offset < unchanged) {
+            bpsAction(patch, bpsSourceRead, unchanged - offset);
+            offset = unchanged;
+        }
+        start = offset;
+
+        // and use new data for everything else, copying repeated bytes from the
+        // modified data instead of storing them all
+        while (offset < end) {
+            uint size = runLength(modified, offset, end);
+
+            if (size >= 8) {
+                bpsAction(patch, bpsTargetRead, offset + 1 - start);
+                patch.append(modified.constData() + start, offset + 1 - start);
+
+                int distance = offset - copyOffset;
+                bpsAction(patch, bpsTargetCopy, size - 1);
+                bpsNumber(patch, ((uint64_t)qAbs(distance) << 1) | (distance < 0));
+                copyOffset = offset + size - 1;
+
+                offset += size;
+                start = offset;
+            } else {
+                offset += size;
+            }
+        }
+
+        if (offset > start) {
+            bpsAction(patch, bpsTargetRead, offset - start);
+            patch.append(modified.constData() + start, offset - start);
+        }
+    }
+
+    appendLittleEndian(patch, crc32(original.constData(), original.size()));
+    appendLittleEndian(patch, crc32(modified.constData(), modified.size()));
+    appendLittleEndian(patch, crc32(patch.constData(), patch.size()));
+    return patch;
+}
+
+/*
+  Saves everything that has changed in a ROM since it was last loaded or saved
+  as a patch, without changing the ROM itself.
+  The patch is saved as BPS if the file name ends in .bps, or as IPS otherwise.
+  Returns the number of bytes that changed, or -1 if saving failed.
+*/
+int savePatch(ROMFile &file, QString path) {
+    file.writePointerTables();
+    QList<QPair<uint, uint> > changes = file.changedRanges();
+
+    QByteArray patch;
+    if (QFileInfo(path).suffix().compare("bps", Qt::CaseInsensitive) == 0)
+        patch = createBPS(file.getOriginalImage(), file.getImage(), changes);
+    else
+        patch = createIPS(file.getImage(), changes);
+
+    if (patch.isNull())
+        return -1;
+
+    QSaveFile out(path);
+    if (!out.open(QIODevice::WriteOnly)
+            || out.write(patch) != patch.size()
+            || !out.commit())
+        return -1;
+
+    int changed = 0;
+    for (QList<QPair<uint, uint> >::const_iterator i = changes.begin(); i != changes.end(); i++)
+        changed += i->second;
 
-    return false;
+    return changed;
 }
@@ -19,6 +19,14 @@ extern const QStringList extraDataPatches;
 
 int getGameVersion(QWidget *parent = 0);
 
+bool applyIPS(const QByteArray& patch, QByteArray& data, QString *error = 0);
 bool applyPatch(ROMFile& file, QString path);
+bool applyPatchesToFile(const QStringList& patches, QString inPath, QString outPath,
+                        QString *error = 0);
+
+QByteArray createIPS(const QByteArray& modified, const QList<QPair<uint, uint> >& changes);
+QByteArray createBPS(const QByteArray& original, const QByteArray& modified,
+                     const QList<QPair<uint, uint> >& changes);
+int savePatch(ROMFile& file, QString path);
 
 #endif // PATCHES_H
@@ -0,0 +1,393 @@
+/*
+  projectcache.cpp
+  On-disk cache of everything decoded from a ROM when it's opened (rooms, tilesets,
+  and map clear data), so reopening the same ROM later doesn't need to decompress
+  anything.
+
+  Cache files are kept in the user's cache directory and named after a hash of the
+  ROM image, so they're only ever used for exactly the same ROM they were made from.
+  They're laid out as a flat block meant to be mapped into memory and read from there:
+
+    projectHeader_t
+    metatile_t tilesets[NUM_TILESETS][0x100]
+    uint8_t    tileSubtract[NUM_TILESETS]
+    map clear data: for each map and level, a uint16_t count, then x/y/w/h for each rect
+    level records, each one being:
+      levelRecord_t
+      tile data (numScreens unique screens of SCREEN_SIZE tiles each, which screenMap
+                 assigns to each position in the level, row by row)
+      sprite_t[numSprites]
+      exit_t[numExits]
+
+  This code is released under the terms of the MIT license.
+  See COPYING.txt for details.
+*/
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "projectcache.h"
+#include "tileset.h"
+#include "mapclear.h"
+
+#define CACHE_MAGIC   0x4B505257 // "KPRJ"
+#define CACHE_VERSION 3
+// number of cache files to keep around (i.e. for the last few saved versions of a ROM)
+#define CACHE_MAX_FILES 16
+
+/*
+  Fixed-size part of a level record.
+*/
+struct levelRecord_t {
+    header_t    header;
+    extradata_t extra;
+    uint8_t     tileset;
+    uint8_t     noReturn;
+    // which unique screen is used at each position (positions that share a screen
+    // in the level also share it when it's loaded from the cache)
+    uint8_t     numScreens;
+    uint8_t     screenMap[16];
+    uint16_t    numSprites;
+    uint16_t    numExits;
+};
+
+#define CACHE_LAYOUT (sizeof(levelRecord_t) | sizeof(sprite_t) << 8 \
+                      | sizeof(exit_t) << 16 | sizeof(metatile_t) << 24)
+
+#define TILESETS_SIZE (sizeof(metatile_t) * NUM_TILESETS * 0x100 + NUM_TILESETS)
+
+ProjectCache::ProjectCache() :
+    data(NULL),
+    size(0)
+{}
+
+ProjectCache::~ProjectCache() {
+    close();
+}
+
+/*
+  Opens the cache file for a ROM, if there is one.
+  Returns false if there isn't or it doesn't match the ROM.
+*/
+bool ProjectCache::open(const ROMView& rom) {
+    close();
+
+    QByteArray hash = romHash(rom);
+    file.setFileName(path(hash));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    size = file.size();
+    if ((quint64)size >= sizeof(header))
+        data = file.map(0, size);
+
+    if (!data) {
+        close();
+        return false;
+    }
+
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION
+            || header.layout != CACHE_LAYOUT
+            || memcmp(header.hash, hash.constData(), PROJECT_HASH_SIZE)
+            || header.globalsSize < TILESETS_SIZE
+            || header.globalsSize > size - sizeof(header)) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void ProjectCache::close() {
+    if (data)
+        file.unmap((uchar*)data);
+    file.close();
+
+    data = NULL;
+    size = 0;
+}
+
+bool ProjectCache::isOpen() const {
+    return data != NULL;
+}
+
+/*
+  Returns a level from the cache, or null if it isn't there.
+  This only reads from the mapped file, so levels can be loaded from any thread
+  (as long as the cache stays open.)
+*/
+leveldata_t* ProjectCache::loadLevel(uint num) const {
+    if (!data || num >= NUM_LEVELS)
+        return NULL;
+
+    quint64 offset = header.levelOffset[num];
+    quint64 recordSize = header.levelSize[num];
+    if (!offset || recordSize < sizeof(levelRecord_t)
+            || offset > (quint64)size || recordSize > size - offset)
+        return NULL;
+
+    const uchar *record = data + offset;
+    levelRecord_t info;
+    memcpy(&info, record, sizeof(info));
+    record += sizeof(info);
+
+    const uint numScreens = info.header.screensH * info.header.screensV;
+    if (!info.header.screensH || !info.header.screensV || numScreens > 16
+            || info.numScreens > numScreens
+            || recordSize != sizeof(info) + (info.numScreens * SCREEN_SIZE)
+                             + (info.numSprites * sizeof(sprite_t))
+                             + (info.numExits * sizeof(exit_t)))
+        return NULL;
+
+    leveldata_t *level = new leveldata_t;
+    level->header   = info.header;
+    level->extra    = info.extra;
+    level->tileset  = info.tileset;
+    level->noReturn = info.noReturn;
+    level->modified = false;
+
+    // first position each unique screen is used at
+    int firstUse[16];
+    std::fill(firstUse, firstUse + 16, -1);
+
+    for (uint i = 0; i < numScreens; i++) {
+        uint screen = info.screenMap[i];
+        uint h = i % info.header.screensH;
+        uint v = i / info.header.screensH;
+
+        if (screen >= info.numScreens) {
+            delete level;
+            return NULL;
+        }
+
+        if (firstUse[screen] >= 0) {
+            level->tiles.shareScreen(h, v, firstUse[screen] % info.header.screensH,
+                                     firstUse[screen] / info.header.screensH);
+        } else {
+            level->tiles.setScreen(h, v, record + (screen * SCREEN_SIZE));
+            firstUse[screen] = i;
+        }
+    }
+    record += info.numScreens * SCREEN_SIZE;
+
+    level->sprites.reserve(info.numSprites);
+    for (uint i = 0; i < info.numSprites; i++) {
+        sprite_t sprite;
+        memcpy(&sprite, record, sizeof(sprite_t));
+        record += sizeof(sprite_t);
+
+        level->sprites.add(sprite);
+    }
+
+    level->exits.reserve(info.numExits);
+    for (uint i = 0; i < info.numExits; i++) {
+        exit_t exit;
+        memcpy(&exit, record, sizeof(exit_t));
+        record += sizeof(exit_t);
+
+        level->exits.add(exit);
+    }
+
+    return level;
+}
+
+/*
+  Replaces the current tilesets and map clear data with the ones from the cache.
+  Returns false (and leaves the map clear data alone) if they can't be loaded.
+*/
+bool ProjectCache::loadGlobals() const {
+    if (!data)
+        return false;
+
+    const uchar *globals = data + sizeof(header);
+    const uchar *end = globals + header.globalsSize;
+    std::vector<QRect> rects[7][16];
+
+    // read map clear data first, in case it's broken somehow
+    const uchar *clear = globals + TILESETS_SIZE;
+    for (uint map = 0; map < 7; map++) {
+        for (uint level = 0; level < 16; level++) {
+            uint16_t count;
+            if (end - clear < (int)sizeof(count))
+                return false;
+            memcpy(&count, clear, sizeof(count));
+            clear += sizeof(count);
+
+            if ((end - clear) / (4 * sizeof(uint16_t)) < count)
+                return false;
+            for (uint i = 0; i < count; i++) {
+                uint16_t rect[4];
+                memcpy(rect, clear, sizeof(rect));
+                clear += sizeof(rect);
+
+                rects[map][level].push_back(QRect(rect[0], rect[1], rect[2], rect[3]));
+            }
+        }
+    }
+
+    memcpy(tilesets, globals, sizeof(tilesets));
+    memcpy(tileSubtract, globals + sizeof(tilesets), sizeof(tileSubtract));
+
+    for (uint map = 0; map < 7; map++) {
+        for (uint level = 0; level < 16; level++)
+            mapClearData[map][level].swap(rects[map][level]);
+    }
+
+    return true;
+}
+
+/*
+  Decodes everything from a ROM and saves it to the cache.
+  This doesn't touch anything already loaded, so it can be run in the background.
+*/
+bool ProjectCache::build(const ROMView& rom) {
+    QByteArray hash = romHash(rom);
+    QString cachePath = path(hash);
+    if (cachePath.isEmpty())
+        return false;
+
+    projectHeader_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic   = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.layout  = CACHE_LAYOUT;
+    memcpy(header.hash, hash.constData(), PROJECT_HASH_SIZE);
+
+    // decode every level (and map clear data, which needs the overworlds' sizes)
+    QByteArray levels;
+    std::vector<QRect> mapClear[7][16];
+    for (uint num = 0; num < NUM_LEVELS; num++) {
+        leveldata_t *level = ::loadLevel(rom, num);
+        if (!level)
+            continue;
+
+        if (num < 7)
+            loadMapClearData(rom, num, level->header.screensH, mapClear[num]);
+
+        levelRecord_t info;
+        memset(&info, 0, sizeof(info));
+        info.header     = level->header;
+        info.extra      = level->extra;
+        info.tileset    = level->tileset;
+        info.noReturn   = level->noReturn;
+        info.numSprites = level->sprites.size();
+        info.numExits   = level->exits.size();
+
+        // find which screens are shared with each other
+        QByteArray screens;
+        const uint width = level->header.screensH;
+        for (uint i = 0; i < (uint)width * level->header.screensV; i++) {
+            uint j = 0;
+            while (j < i && !level->tiles.sharesScreen(i % width, i / width, j % width, j / width))
+                j++;
+
+            if (j < i) {
+                info.screenMap[i] = info.screenMap[j];
+            } else {
+                uint8_t screen[SCREEN_SIZE];
+                level->tiles.readScreen(i % width, i / width, screen);
+                screens.append((const char*)screen, SCREEN_SIZE);
+                info.screenMap[i] = info.numScreens++;
+            }
+        }
+
+        header.levelOffset[num] = levels.size();
+        levels.append((const char*)&info, sizeof(info));
+        levels.append(screens);
+
+        for (ObjectList<sprite_t>::const_iterator i = level->sprites.begin();
+             i != level->sprites.end(); i++) {
+            levels.append((const char*)&*i, sizeof(sprite_t));
+        }
+        for (ObjectList<exit_t>::const_iterator i = level->exits.begin();
+             i != level->exits.end(); i++) {
+            levels.append((const char*)&*i, sizeof(exit_t));
+        }
+
+        header.levelSize[num] = levels.size() - header.levelOffset[num];
+        delete level;
+    }
+
+    // decode tilesets
+    std::vector<metatile_t> sets(NUM_TILESETS * 0x100);
+    uint8_t subtract[NUM_TILESETS] = {0};
+    loadTilesets(rom, (metatile_t(*)[0x100])sets.data(), subtract);
+
+    QByteArray globals;
+    globals.append((const char*)sets.data(), sets.size() * sizeof(metatile_t));
+    globals.append((const char*)subtract, sizeof(subtract));
+    for (uint map = 0; map < 7; map++) {
+        for (uint level = 0; level < 16; level++) {
+            const std::vector<QRect>& rects = mapClear[map][level];
+            uint16_t count = rects.size();
+            globals.append((const char*)&count, sizeof(count));
+
+            for (std::vector<QRect>::const_iterator i = rects.begin(); i != rects.end(); i++) {
+                uint16_t rect[4] = {(uint16_t)i->x(), (uint16_t)i->y(),
+                                    (uint16_t)i->width(), (uint16_t)i->height()};
+                globals.append((const char*)rect, sizeof(rect));
+            }
+        }
+    }
+
+    // level offsets are from the start of the file
+    header.globalsSize = globals.size();
+    for (uint num = 0; num < NUM_LEVELS; num++) {
+        if (header.levelSize[num])
+            header.levelOffset[num] += sizeof(header) + globals.size();
+    }
+
+    QDir().mkpath(QFileInfo(cachePath).absolutePath());
+    QSaveFile file(cachePath);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    file.write((const char*)&header, sizeof(header));
+    file.write(globals);
+    file.write(levels);
+    if (!file.commit())
+        return false;
+
+    prune(cachePath);
+    return true;
+}
+
+/*
+  Returns the cache key for a ROM image.
+*/
+QByteArray ProjectCache::romHash(const ROMView& rom) {
+    return QCryptographicHash::hash(rom.getImage(), QCryptographicHash::Sha1);
+}
+
+/*
+  Returns the path of the cache file for a ROM hash
+  (or an empty string if there's nowhere to keep it.)
+*/
+QString ProjectCache::path(const QByteArray& hash) {
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (dir.isEmpty())
+        return QString();
+
+    return dir + "/" + QString::fromLatin1(hash.toHex()) + ".kaleproject";
+}
+
+/*
+  Removes the oldest cache files, once there are too many of them.
+*/
+void ProjectCache::prune(const QString& keep) {
+    QDir dir(QFileInfo(keep).absolutePath());
+    QFileInfoList files = dir.entryInfoList(QStringList("*.kaleproject"), QDir::Files, QDir::Time);
+
+    for (int i = CACHE_MAX_FILES; i < files.size(); i++) {
+        if (files[i].absoluteFilePath() != QFileInfo(keep).absoluteFilePath())
+            QFile::remove(files[i].absoluteFilePath());
+    }
+}
@@ -0,0 +1,67 @@
+/*
+    This code is released under the terms of the MIT license.
+    See COPYING.txt for details.
+*/
+
+#ifndef PROJECTCACHE_H
+#define PROJECTCACHE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <cstdint>
+#include "romfile.h"
+#include "level.h"
+
+#define PROJECT_HASH_SIZE 20
+
+/*
+  Cache file header.
+  Everything in the file is stored the same way it is in memory, so the file
+  can be mapped and read directly.
+*/
+struct projectHeader_t {
+    uint32_t magic;
+    uint32_t version;
+    // sizes of the structs stored in the file, in case any of them change
+    uint32_t layout;
+    uint8_t  hash[PROJECT_HASH_SIZE];
+
+    // tilesets and map clear data (follows the header)
+    uint32_t globalsSize;
+    // per-level records (offset 0 if the level couldn't be loaded)
+    uint32_t levelOffset[NUM_LEVELS];
+    uint32_t levelSize[NUM_LEVELS];
+};
+
+/*
+  Keeps everything decoded from a ROM on disk (keyed by a hash of the ROM image),
+  so opening a ROM that hasn't changed since the last time doesn't need to
+  decompress anything.
+*/
+class ProjectCache {
+public:
+    ProjectCache();
+    ~ProjectCache();
+
+    bool open(const ROMView& rom);
+    void close();
+    bool isOpen() const;
+
+    leveldata_t* loadLevel(uint num) const;
+    bool         loadGlobals() const;
+
+    static bool build(const ROMView& rom);
+
+private:
+    static QByteArray romHash(const ROMView& rom);
+    static QString    path(const QByteArray& hash);
+    static void       prune(const QString& keep);
+
+    QFile           file;
+    const uchar     *data;
+    qint64          size;
+    projectHeader_t header;
+};
+
+#endif // PROJECTCACHE_H
@@ -11,7 +11,11 @@
 
 #include <QFile>
 #include <QMessageBox>
+#include <QMutexLocker>
+#include <QSaveFile>
 #include <QSettings>
+#include <QSharedPointer>
+#include <QThreadStorage>
 
 #include <cstring>
 #include <cstdio>
@@ -30,13 +34,17 @@ ROMFile::ROMFile() : QFile(),
   Returns the corresponding file offset if successful, otherwise
   returns -1.
 */
-uint ROMFile::toOffset(romaddr_t address) const {
+static uint romOffset(romaddr_t address) {
     uint offset = (address.addr % BANK_SIZE) + ((address.bank & 0x7F) * BANK_SIZE)
                   + HEADER_SIZE;
 
     return offset;
 }
 
+uint ROMFile::toOffset(romaddr_t address) const {
+    return romOffset(address);
+}
+
 uint ROMFile::getNumPRGBanks() const {
     return numPRGBanks;
 }
@@ -55,6 +63,12 @@ bool ROMFile::openROM(OpenMode flags) {
     if (!this->open(flags))
         return false;
 
+    // read the whole thing at once, everything else is done in memory
+    image = this->readAll();
+    original = image;
+    dirty.clear();
+    pointerTables.clear();
+
     // make sure this is an actual Kirby's Adventure ROM
     // (by looking at the reset code)
     romaddr_t checkAddr = {0x3F, 0xFFF0};
@@ -66,25 +80,141 @@ bool ROMFile::openROM(OpenMode flags) {
                               "Please select a valid Kirby's Adventure ROM.",
                               QMessageBox::Ok);
         this->close();
+        image.clear();
+        original.clear();
         return false;
     }
 
-    numPRGBanks = 0;
-    numCHRBanks = 0;
-
     // get size of PRG/CHR banks
-    this->seek(4);
-    this->read((char*)&numPRGBanks, 1);
     // iNES uses 16kb PRG banks, MMC3 uses 8kb
-    numPRGBanks *= 2;
-    this->seek(5);
-    this->read((char*)&numCHRBanks, 1);
+    numPRGBanks = (uint8_t)image[4] * 2;
     // iNES uses 8kb CHR banks, we use 1kb
-    numCHRBanks *= 8;
+    numCHRBanks = (uint8_t)image[5] * 8;
 
     return true;
 }
 
+/*
+  Writes all changes to the ROM back to the file.
+  The file is replaced all at once (by writing a temporary file and then renaming it)
+  so that it can't be left half-saved if something goes wrong. If nothing actually
+  changed, the file isn't written to at all.
+
+  Returns the number of bytes that changed, or -1 if saving failed.
+*/
+int ROMFile::saveROM() {
+    writePointerTables();
+
+    QList<QPair<uint, uint> > ranges = changedRanges();
+    int changed = 0;
+
+    for (QList<QPair<uint, uint> >::const_iterator i = ranges.begin(); i != ranges.end(); i++)
+        changed += i->second;
+
+    if (changed) {
+        // (some systems won't let the old file be replaced while it's still open)
+        this->close();
+
+        QSaveFile file(this->fileName());
+        file.setDirectWriteFallback(true);
+        if (!file.open(QIODevice::WriteOnly)
+                || file.write(image) != image.size()
+                || !file.commit())
+            return -1;
+    }
+
+    original = image;
+    dirty.clear();
+    return changed;
+}
+
+/*
+  Returns the offsets and lengths of all parts of the ROM which are different
+  from the last time it was loaded or saved, in order.
+  (Changes to pointer tables aren't included until writePointerTables is called.)
+*/
+QList<QPair<uint, uint> > ROMFile::changedRanges() const {
+    QList<QPair<uint, uint> > ranges;
+    const char *newData = image.constData();
+    const char *oldData = original.constData();
+
+    for (std::map<uint, uint>::const_iterator i = dirty.begin(); i != dirty.end(); i++) {
+        uint offset = i->first;
+        while (offset < i->second) {
+            // skip anything that was written to but didn't actually change
+            while (offset < i->second && newData[offset] == oldData[offset])
+                offset++;
+            if (offset == i->second)
+                break;
+
+            uint start = offset;
+            while (offset < i->second && newData[offset] != oldData[offset])
+                offset++;
+
+            // join this to the previous range if they're right next to each other
+            if (!ranges.isEmpty() && ranges.back().first + ranges.back().second == start)
+                ranges.back().second += offset - start;
+            else
+                ranges.append(qMakePair(start, offset - start));
+        }
+    }
+
+    return ranges;
+}
+
+/*
+  Returns the current (possibly modified) contents of the ROM.
+*/
+const QByteArray& ROMFile::getImage() const {
+    return image;
+}
+
+/*
+  Returns the contents of the ROM as of the last time it was loaded or saved.
+*/
+const QByteArray& ROMFile::getOriginalImage() const {
+    return original;
+}
+
+/*
+  Replaces the entire contents of the ROM (i.e. after applying a patch to it).
+  The new contents must be the same size as the old ones.
+*/
+bool ROMFile::setImage(const QByteArray& data) {
+    if (data.size() != image.size())
+        return false;
+
+    image = data;
+    markDirty(0, image.size());
+    pointerTables.clear();
+    return true;
+}
+
+/*
+  Keeps track of a part of the ROM that has been written to, combining it with
+  any other overlapping or adjacent parts.
+*/
+void ROMFile::markDirty(uint offset, uint size) {
+    uint end = offset + size;
+
+    std::map<uint, uint>::iterator i = dirty.upper_bound(offset);
+    if (i != dirty.begin()) {
+        std::map<uint, uint>::iterator prev = i;
+        prev--;
+        if (prev->second >= offset) {
+            offset = prev->first;
+            end = qMax(end, prev->second);
+            dirty.erase(prev);
+        }
+    }
+    while (i != dirty.end() && i->first <= end) {
+        end = qMax(end, i->second);
+        i = dirty.erase(i);
+    }
+
+    dirty[offset] = end;
+}
+
 /*
   Reads data from a file into a pre-existing char buffer.
   If "size" == 0, the data is decompressed, with a maximum decompressed
@@ -93,21 +223,29 @@ bool ROMFile::openROM(OpenMode flags) {
   Returns the size of the data read from the file, or 0 if the read was
   unsuccessful.
 */
-size_t ROMFile::readBytes(romaddr_t addr, uint size, void *buffer) {
+static size_t readImage(const QByteArray& image, uint offset, uint size, void *buffer) {
+    if (offset >= (uint)image.size())
+        return 0;
+
+    const uint8_t *data = (const uint8_t*)image.constData() + offset;
+    uint available = image.size() - offset;
+
     if (!size) {
-        char packed[DATA_SIZE];
-        this->seek(toOffset(addr));
-        if (this->read(packed, DATA_SIZE) > 0)
-            return unpack((uint8_t*)packed, (uint8_t*)buffer);
-        else
-            return 0;
+        // (the compressed data can't run past the end of the file, so make sure
+        //  decompression doesn't either)
+        return unpack_bounded(data, available, (uint8_t*)buffer, DATA_SIZE, NULL);
 
     } else {
-        this->seek(toOffset(addr));
-        return qMax((int)read((char*)buffer, size), 0);
+        size = qMin(size, available);
+        memcpy(buffer, data, size);
+        return size;
     }
 }
 
+size_t ROMFile::readBytes(romaddr_t addr, uint size, void *buffer) {
+    return readImage(image, toOffset(addr), size, buffer);
+}
+
 uint8_t ROMFile::readByte(romaddr_t addr) {
     uint8_t data;
     readBytes(addr, 1, &data);
@@ -127,37 +265,14 @@ uint32_t ROMFile::readInt32(romaddr_t addr) {
 }
 
 /*
-  Reads a 24-bit ROM pointer from a file, then dereferences the pointer and
-  reads from the address pointed to. If "size" == 0, the data is decompressed.
+  Dereferences a pointer from a pointer table and reads from the address pointed to.
+  If "size" == 0, the data is decompressed.
 
   Returns the size of data read, or 0 if unsuccessful.
-
-  readFromShortPointer takes a constant bank number instead of bank pointer.
 */
-romaddr_t ROMFile::readPointer(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB,
-                               uint offset) {
-    return {this->readByte(addrB + offset) & 0x7Fu,
-            this->readByte(addrH + offset)*256u + this->readByte(addrL + offset)};
-}
-romaddr_t ROMFile::readShortPointer(romaddr_t addrL, romaddr_t addrH, uint bank,
-                               uint offset) {
-    return {bank,
-            this->readByte(addrH + offset)*256u + this->readByte(addrL + offset)};
-}
-
-size_t ROMFile::readFromPointer(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB,
-                                uint size, void *buffer, uint offset) {
-    memset(buffer, 0, 0x10000);
-    romaddr_t addr = readPointer(addrL, addrH, addrB, offset);
-    if (addr.addr)
-        return this->readBytes(addr, size, buffer);
-
-    return 0;
-}
-size_t ROMFile::readFromShortPointer(romaddr_t addrL, romaddr_t addrH, uint bank,
-                                     uint size, void *buffer, uint offset) {
+size_t ROMFile::readFromPointer(const PointerTable& table, uint size, void *buffer, uint offset) {
     memset(buffer, 0, 0x10000);
-    romaddr_t addr = readShortPointer(addrL, addrH, bank, offset);
+    romaddr_t addr = table[offset];
     if (addr.addr)
         return this->readBytes(addr, size, buffer);
 
@@ -180,8 +295,11 @@ uint ROMFile::writeBytes(romaddr_t addr, uint size, const void *buffer) {
         offset += spaceLeft;
 
     // now write data to file
-    this->seek(offset);
-    this->write((const char*)buffer, size);
+    if (offset < (uint)image.size()) {
+        size = qMin(size, image.size() - offset);
+        memcpy(image.data() + offset, buffer, size);
+        markDirty(offset, size);
+    }
 
     // return new ROM address
     // (TODO: redo this)
@@ -202,38 +320,155 @@ uint ROMFile::writeInt32(romaddr_t addr, uint32_t data) {
 }
 
 /*
-  Writes data to an offset in a file, and then writes the 24-bit pointer
-  to that data into a second offset.
+  Writes data to an offset in a file, and then updates a pointer table to point to it.
 */
-uint ROMFile::writeToPointer(romaddr_t ptrL, romaddr_t ptrH, romaddr_t ptrB, romaddr_t addr,
-                            uint size, const void *buffer, uint offset) {
-    writeByte(ptrL + offset, addr.addr & 0xFF);
-    writeByte(ptrH + offset, addr.addr >> 8);
-    writeByte(ptrB + offset, addr.bank);
+uint ROMFile::writeToPointer(PointerTable& table, romaddr_t addr,
+                             uint size, const void *buffer, uint offset) {
+    table.set(offset, addr);
 
     return writeBytes(addr, size, buffer);
 }
 
-uint ROMFile::writeToShortPointer(romaddr_t ptrL, romaddr_t ptrH, romaddr_t addr,
-                            uint size, const void *buffer, uint offset) {
-    writeByte(ptrL + offset, addr.addr & 0xFF);
-    writeByte(ptrH + offset, addr.addr >> 8);
+/*
+  Returns a pointer table, reading the whole thing from the ROM the first time it's used.
+  The short pointer version is for tables which only have low and high bytes, and
+  where every pointer is to the same bank.
+*/
+PointerTable& ROMFile::pointerTable(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB, uint size) {
+    return loadPointerTable(addrL, addrH, addrB, true, size);
+}
+PointerTable& ROMFile::pointerTable(romaddr_t addrL, romaddr_t addrH, uint bank, uint size) {
+    return loadPointerTable(addrL, addrH, {bank, 0}, false, size);
+}
 
-    return writeBytes(addr, size, buffer);
+PointerTable& ROMFile::loadPointerTable(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB,
+                                        bool hasBank, uint size) {
+    PointerTable& table = pointerTables[toOffset(addrL)];
+    if (table.size() >= size)
+        return table;
+
+    // (if the table was already used with a smaller size, keep any changes to it)
+    writePointerTables();
+    table.read(image, addrL, addrH, addrB, hasBank, size);
+
+    return table;
 }
 
 /*
- * Read a 1KB CHR ROM bank and return it as an 8-bit QImage with default grey palettes.
+  Writes all changed pointer tables back to the ROM.
+*/
+void ROMFile::writePointerTables() {
+    for (std::map<uint, PointerTable>::iterator i = pointerTables.begin(); i != pointerTables.end(); i++) {
+        PointerTable& table = i->second;
+        if (!table.changed)
+            continue;
+
+        uint size = table.size();
+        std::vector<uint8_t> low(size), high(size), bank(size);
+        for (uint j = 0; j < size; j++) {
+            low[j]  = table.pointers[j].addr & 0xFF;
+            high[j] = table.pointers[j].addr >> 8;
+            bank[j] = table.pointers[j].bank;
+        }
+
+        writeBytes(table.addrL, size, low.data());
+        writeBytes(table.addrH, size, high.data());
+        if (table.hasBank)
+            writeBytes(table.addrB, size, bank.data());
+
+        table.changed = false;
+    }
+}
+
+/*
+  Reads and decodes an entire pointer table from the contents of a ROM.
+*/
+void PointerTable::read(const QByteArray& image, romaddr_t addrL, romaddr_t addrH, romaddr_t addrB,
+                        bool hasBank, uint size) {
+    std::vector<uint8_t> low(size), high(size), bank(size, addrB.bank);
+    readImage(image, romOffset(addrL), size, low.data());
+    readImage(image, romOffset(addrH), size, high.data());
+    if (hasBank)
+        readImage(image, romOffset(addrB), size, bank.data());
+
+    this->addrL = addrL;
+    this->addrH = addrH;
+    this->addrB = addrB;
+    this->hasBank = hasBank;
+    this->changed = false;
+    pointers.resize(size);
+    for (uint i = 0; i < size; i++) {
+        pointers[i] = {bank[i], high[i] * 256u + low[i]};
+    }
+}
+
+PointerTable::PointerTable() :
+    addrL({0, 0}),
+    addrH({0, 0}),
+    addrB({0, 0}),
+    hasBank(false),
+    changed(false)
+{}
+
+uint PointerTable::size() const {
+    return pointers.size();
+}
+
+/*
+  Returns a pointer from the table, ignoring the high bit of the bank byte
+  (which some tables use as a flag.)
+*/
+romaddr_t PointerTable::operator[](uint num) const {
+    if (num >= pointers.size())
+        return {0, 0};
+
+    return {pointers[num].bank & 0x7Fu, pointers[num].addr};
+}
+
+uint8_t PointerTable::bankByte(uint num) const {
+    if (num >= pointers.size())
+        return 0;
+
+    return pointers[num].bank;
+}
+
+void PointerTable::set(uint num, romaddr_t addr) {
+    if (num >= pointers.size())
+        return;
+
+    if (!hasBank)
+        addr.bank = addrB.bank;
+    pointers[num] = {addr.bank & 0xFFu, addr.addr & 0xFFFFu};
+    changed = true;
+}
+
+/*
+ * Decode a 1KB CHR bank into an 8-bit QImage with default grey palettes.
  * The QImage will be 512x32, or 64x4 NES tiles.
  * Each row of tiles (8 pixels) represents the same tiles with one of the 4 possible palettes.
  * The palettes use color indices 1-3, 4-6, 7-9, and 10-12, and index 0 is BG color.
  */
-QImage ROMFile::readCHRBank(uint bank) {
-    uchar  chr[CHR_SIZE];
-    QImage tiles(512, 32, QImage::Format_Indexed8);
+static QImage decodeCHRBank(const uint8_t *chr) {
+    // each bit of a bitplane byte spread out into its own byte, in the order
+    // the pixels are stored in the image (leftmost pixel first)
+    static const struct spreadTable_t {
+        uint64_t entry[256];
+
+        spreadTable_t() {
+            for (uint i = 0; i < 256; i++) {
+                entry[i] = 0;
+                for (uint col = 0; col < 8; col++) {
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+                    entry[i] |= (uint64_t)((i >> col) & 1) << (col * 8);
+#else
+                    entry[i] |= (uint64_t)((i >> (7 - col)) & 1) << (col * 8);
+#endif
+                }
+            }
+        }
+    } spread;
 
-    this->seek(16 + (numPRGBanks * BANK_SIZE) + (bank * CHR_SIZE));
-    this->read((char*)chr, CHR_SIZE);
+    QImage tiles(512, 32, QImage::Format_Indexed8);
 
     for (uint line = 0; line < 8; line++) {
         uchar* lines[] = {
@@ -245,21 +480,14 @@ QImage ROMFile::readCHRBank(uint bank) {
         for (uint tile = 0; tile < 64; tile++) {
             uchar plane0 = chr[tile*16 + line];
             uchar plane1 = chr[tile*16 + line + 8];
-            for (uint col = 0; col < 8; col++) {
-                uint idx = tile * 8 + col;
-
-                uchar color = ((plane0 >> (7 - col)) & 1) + ((plane1 >> (7 - col)) & 1) * 2;
-                if (color) {
-                    lines[0][idx] = color;
-                    lines[1][idx] = color + 3;
-                    lines[2][idx] = color + 6;
-                    lines[3][idx] = color + 9;
-                } else {
-                    lines[0][idx] = 0;
-                    lines[1][idx] = 0;
-                    lines[2][idx] = 0;
-                    lines[3][idx] = 0;
-                }
+
+            // decode all 8 pixels at once, then add 3 to each non-zero pixel
+            // for each of the other palettes
+            uint64_t color  = spread.entry[plane0] | (spread.entry[plane1] << 1);
+            uint64_t opaque = spread.entry[plane0 | plane1];
+            for (uint pal = 0; pal < 4; pal++) {
+                uint64_t pixels = color + opaque * (pal * 3);
+                memcpy(lines[pal] + tile * 8, &pixels, 8);
             }
         }
     }
@@ -281,3 +509,128 @@ QImage ROMFile::readCHRBank(uint bank) {
 
     return tiles;
 }
+
+ROMView::ROMView() :
+    numPRGBanks(0),
+    numCHRBanks(0),
+    tableCache(new tableCache_t)
+{}
+
+ROMView::ROMView(const QByteArray& image, uint numPRGBanks, uint numCHRBanks) :
+    image(image),
+    numPRGBanks(numPRGBanks),
+    numCHRBanks(numCHRBanks),
+    tableCache(new tableCache_t)
+{}
+
+/*
+  Returns a read-only view of the ROM as it is right now
+  (including any changes to pointer tables, which are written back first.)
+*/
+ROMView ROMFile::view() {
+    writePointerTables();
+    return ROMView(image, numPRGBanks, numCHRBanks);
+}
+
+uint ROMView::getNumPRGBanks() const {
+    return numPRGBanks;
+}
+uint ROMView::getNumCHRBanks() const {
+    return numCHRBanks;
+}
+const QByteArray& ROMView::getImage() const {
+    return image;
+}
+
+uint ROMView::toOffset(romaddr_t address) const {
+    return romOffset(address);
+}
+
+/*
+  Reads data from the ROM, the same way as ROMFile::readBytes.
+*/
+size_t ROMView::readBytes(romaddr_t addr, uint size, void *buffer) const {
+    return readImage(image, toOffset(addr), size, buffer);
+}
+
+uint8_t ROMView::readByte(romaddr_t addr) const {
+    uint8_t data = 0;
+    readBytes(addr, 1, &data);
+    return data;
+}
+
+uint16_t ROMView::readInt16(romaddr_t addr) const {
+    uint16_t data = 0;
+    readBytes(addr, 2, &data);
+    return data;
+}
+
+size_t ROMView::readFromPointer(const PointerTable& table, uint size, void *buffer, uint offset) const {
+    memset(buffer, 0, 0x10000);
+    romaddr_t addr = table[offset];
+    if (addr.addr)
+        return this->readBytes(addr, size, buffer);
+
+    return 0;
+}
+
+/*
+  Returns a pointer table, reading the whole thing the first time it's used
+  from any copy of this view.
+*/
+const PointerTable& ROMView::pointerTable(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB, uint size) const {
+    return loadPointerTable(addrL, addrH, addrB, true, size);
+}
+const PointerTable& ROMView::pointerTable(romaddr_t addrL, romaddr_t addrH, uint bank, uint size) const {
+    return loadPointerTable(addrL, addrH, {bank, 0}, false, size);
+}
+
+const PointerTable& ROMView::loadPointerTable(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB,
+                                              bool hasBank, uint size) const {
+    QMutexLocker lock(&tableCache->mutex);
+
+    // (tables are never removed or changed once they've been read, and the same table
+    //  used with a different size is a separate entry, so references to it stay valid
+    //  after the lock is released)
+    PointerTable& table = tableCache->tables[std::make_pair(toOffset(addrL), size)];
+    if (table.size() != size)
+        table.read(image, addrL, addrH, addrB, hasBank, size);
+
+    return table;
+}
+
+/*
+ * Read a 1KB CHR ROM bank and return it as an 8-bit QImage with default grey palettes.
+ * (see decodeCHRBank)
+ */
+QImage ROMView::readCHRBank(uint bank) const {
+    uchar  chr[CHR_SIZE] = {0};
+
+    uint offset = HEADER_SIZE + (numPRGBanks * BANK_SIZE) + (bank * CHR_SIZE);
+    if (offset < (uint)image.size())
+        memcpy(chr, image.constData() + offset, qMin((uint)CHR_SIZE, image.size() - offset));
+
+    return decodeCHRBank(chr);
+}
+
+/*
+  Compresses level maps and tilesets (other types don't get compressed.)
+
+  Each thread keeps its own compression work area around until it exits, so saving
+  doesn't need to allocate a new one for every chunk.
+*/
+void DataChunk::pack(int mode) {
+    static QThreadStorage<QSharedPointer<pack_scratch_t> > scratch;
+
+    if (type == level || type == tileset) {
+        if (!scratch.hasLocalData())
+            scratch.setLocalData(QSharedPointer<pack_scratch_t>(pack_scratch_new(), pack_scratch_free));
+
+        pack_scratch_t *work = scratch.localData().data();
+
+        // (if the work area couldn't be allocated, neither could pack()'s own one)
+        uint8_t packed[DATA_SIZE];
+        size = work ? pack_with_scratch(data.data(), size, packed, mode, work) : 0;
+        data.assign(packed, packed + size);
+    }
+}
@@ -8,8 +8,15 @@
 
 #include <cstdio>
 #include <QFile>
+#include <QByteArray>
+#include <QList>
+#include <QPair>
 #include <QImage>
+#include <QMutex>
+#include <QSharedPointer>
 #include <cstdint>
+#include <map>
+#include <vector>
 #include "compress.h"
 
 #define BANK_SIZE 0x2000
@@ -25,12 +32,90 @@ struct romaddr_t {
     }
 };
 
+/*
+  A table of pointers, stored in the ROM as separate tables of low, high and
+  (optionally) bank bytes. The whole table is read at once the first time it's used,
+  and written back at once when the ROM is saved.
+*/
+class PointerTable {
+public:
+    PointerTable();
+
+    uint      size() const;
+    romaddr_t operator[](uint num) const;
+    uint8_t   bankByte(uint num) const;
+    void      set(uint num, romaddr_t addr);
+
+private:
+    friend class ROMFile;
+    friend class ROMView;
+
+    romaddr_t addrL, addrH, addrB;
+    // short pointer tables have no bank byte table, and always use bank addrB.bank
+    bool hasBank;
+    // (pointers are stored with the whole bank byte, including any flags in the high bit)
+    std::vector<romaddr_t> pointers;
+    bool changed;
+
+    void read(const QByteArray& image, romaddr_t addrL, romaddr_t addrH, romaddr_t addrB,
+              bool hasBank, uint size);
+};
+
+/*
+  A read-only copy of the contents of a ROM at some point in time, which can be used
+  from any number of threads at once (unlike ROMFile itself).
+  Copies of a view all share the same data, and changes to the ROMFile it came from
+  don't affect it.
+*/
+class ROMView {
+public:
+    ROMView();
+    ROMView(const QByteArray& image, uint numPRGBanks, uint numCHRBanks);
+
+    uint getNumPRGBanks() const;
+    uint getNumCHRBanks() const;
+    const QByteArray& getImage() const;
+
+    uint toOffset(romaddr_t addr) const;
+
+    size_t       readBytes(romaddr_t addr, uint size, void *buffer) const;
+    uint8_t      readByte(romaddr_t addr) const;
+    uint16_t     readInt16(romaddr_t addr) const;
+    size_t       readFromPointer(const PointerTable& table, uint size, void *buffer, uint offset = 0) const;
+
+    const PointerTable& pointerTable(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB, uint size) const;
+    const PointerTable& pointerTable(romaddr_t addrL, romaddr_t addrH, uint bank, uint size) const;
+
+    QImage readCHRBank(uint bank) const;
+
+private:
+    QByteArray image;
+    uint numPRGBanks, numCHRBanks;
+
+    // pointer tables that have been read from this view so far (shared by all copies of it)
+    // keyed by offset and size
+    struct tableCache_t {
+        QMutex mutex;
+        std::map<std::pair<uint, uint>, PointerTable> tables;
+    };
+    QSharedPointer<tableCache_t> tableCache;
+
+    const PointerTable& loadPointerTable(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB,
+                                         bool hasBank, uint size) const;
+};
+
 class ROMFile: public QFile {
 public:
 
     ROMFile();
 
     bool         openROM(OpenMode flags);
+    int          saveROM();
+    QList<QPair<uint, uint> > changedRanges() const;
+    const QByteArray& getImage() const;
+    const QByteArray& getOriginalImage() const;
+    bool              setImage(const QByteArray& data);
+    ROMView           view();
 
     uint getNumPRGBanks() const;
     uint getNumCHRBanks() const;
@@ -41,51 +126,70 @@ public:
     uint8_t      readByte(romaddr_t addr);
     uint16_t     readInt16(romaddr_t addr);
     uint32_t     readInt32(romaddr_t addr);
-    romaddr_t    readPointer(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB, uint offset);
-    romaddr_t    readShortPointer(romaddr_t addrL, romaddr_t addrH, uint bank, uint offset);
-    size_t       readFromPointer(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB,
-                                 uint size, void *buffer, uint offset = 0);
-    size_t       readFromShortPointer(romaddr_t addrL, romaddr_t addrH, uint bank,
-                                      uint size, void *buffer, uint offset = 0);
+    size_t       readFromPointer(const PointerTable& table, uint size, void *buffer, uint offset = 0);
     uint writeBytes(romaddr_t addr, uint size, const void *buffer);
     uint writeByte(romaddr_t addr, uint8_t data);
     uint writeInt16(romaddr_t addr, uint16_t data);
     uint writeInt32(romaddr_t addr, uint32_t data);
-    uint writeToPointer(romaddr_t ptrL, romaddr_t ptrH, romaddr_t ptrB, romaddr_t addr,
+    uint writeToPointer(PointerTable& table, romaddr_t addr,
                         uint size, const void *buffer, uint offset = 0);
-    uint writeToShortPointer(romaddr_t ptrL, romaddr_t ptrH, romaddr_t addr,
-                             uint size, const void *buffer, uint offset = 0);
 
-    QImage readCHRBank(uint bank);
+    PointerTable& pointerTable(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB, uint size);
+    PointerTable& pointerTable(romaddr_t addrL, romaddr_t addrH, uint bank, uint size);
+    void          writePointerTables();
+
 private:
 
     uint numPRGBanks, numCHRBanks;
+
+    // contents of the entire ROM, loaded by openROM and written back by saveROM
+    // (all reads and writes use this instead of the file itself)
+    QByteArray image;
+    // contents of the ROM as of the last time it was loaded or saved
+    QByteArray original;
+    // parts of the ROM that have been written to since then (start offset -> end offset)
+    std::map<uint, uint> dirty;
+
+    // pointer tables that have been used since the ROM was loaded (by offset of the low bytes)
+    std::map<uint, PointerTable> pointerTables;
+
+    void markDirty(uint offset, uint size);
+    PointerTable& loadPointerTable(romaddr_t addrL, romaddr_t addrH, romaddr_t addrB,
+                                   bool hasBank, uint size);
 };
 
 // small helper for generating and sorting compressed (or not) data
 // to be organized within the ROM based on size
+// (chunks only own as much memory as their data actually needs, and can only be moved,
+//  so building/sorting/removing them while saving never copies any data around)
 struct DataChunk {
     enum type_e {
         level, tileset, enemy, banks
     };
 
-    uint8_t  data[DATA_SIZE];
+    std::vector<uint8_t> data;
     uint16_t size;
     type_e   type;
     uint     num;
 
+    // level maps and tilesets are stored uncompressed until pack() is called
     DataChunk(const void *src, uint16_t size, type_e type, uint num):
         size(size), type(type), num(num)
     {
-        // level maps and tilesets get compressed, other types don't
-        // (and the CHR bank tables don't even need a real pointer)
-        if (type == level || type == tileset) {
-            this->size = pack((uint8_t*)src, size, this->data, 0);
-        } else if (type == enemy) {
-            memcpy(data, src, size);
+        // (the CHR bank tables don't even need a real pointer)
+        if (src) {
+            data.assign((const uint8_t*)src, (const uint8_t*)src + size);
         }
     }
 
+    DataChunk(DataChunk&&) = default;
+    DataChunk& operator= (DataChunk&&) = default;
+    DataChunk(const DataChunk&) = delete;
+    DataChunk& operator= (const DataChunk&) = delete;
+
+    // compresses level maps and tilesets, other types don't get compressed
+    void pack(int mode = PACK_NORMAL);
+
     bool operator< (const DataChunk &other) const {
         if (size == other.size)
             return num < other.num;
@@ -0,0 +1,414 @@
+/*
+  savejob.cpp
+  Saves all level data to a ROM in the background: everything is compressed, fitted
+  into the available ROM banks, written to a copy of the ROM in memory, and decoded
+  again to check it before anything is written to disk.
+
+  This code is released under the terms of the MIT license.
+  See COPYING.txt for details.
+*/
+
+#include <QtConcurrent>
+#include <algorithm>
+#include <cstring>
+
+#include "savejob.h"
+#include "compress.h"
+#include "mapclear.h"
+#include "patches.h"
+#include "stuff.h"
+
+// level data starts after the first 0xA00 bytes of bank 0 (used by palettes)
+static const romaddr_t dataStart = {0x00, 0x0A00};
+// number of banks available for level data
+static const uint lastBank = 0x12;
+// number of the biggest chunks to retry with optimal compression at first,
+// if everything doesn't fit in the ROM
+static const uint optimalRetrySize = 8;
+
+SaveJob::SaveJob(const QString& fileName, const QString& patchName, int packMode,
+                 const ChunkCache& packCache, const QString& packCachePath) :
+    fileName(fileName),
+    patchName(patchName),
+    result(failed),
+    changed(0),
+    slowestRoom(0),
+    slowestCycles(0),
+    packCache(packCache),
+    packCachePath(packCachePath),
+    packMode(packMode),
+    packed(0),
+    cancelFlag(0)
+{}
+
+/*
+  Stops the job as soon as possible. Can be called from any thread.
+  (Once the ROM or patch is actually being written, it's too late to cancel.)
+*/
+void SaveJob::cancel() {
+    cancelFlag.storeRelease(1);
+}
+
+bool SaveJob::isCancelled() const {
+    return cancelFlag.loadAcquire() != 0;
+}
+
+/*
+  Runs the whole save. This only uses the job's own copy of everything, so it's safe
+  to run on another thread while the editor keeps being used.
+*/
+void SaveJob::run() {
+    result = failed;
+
+    const QIODevice::OpenMode mode = patchName.isNull() ? QIODevice::ReadWrite : QIODevice::ReadOnly;
+
+    ROMFile rom;
+    rom.setFileName(fileName);
+    if (!rom.openROM(mode)) {
+        error = tr("Unable to open %1.").arg(fileName);
+        return;
+    }
+
+    std::list<DataChunk> chunks;
+    if (!pack(chunks) || !write(rom, chunks) || !verify(rom.view())) {
+        if (isCancelled())
+            result = cancelled;
+        return;
+    }
+
+    // or just save what changed as a patch
+    if (!patchName.isNull()) {
+        emit progress(0, 0, tr("Saving %1...").arg(patchName));
+
+        changed = savePatch(rom, patchName);
+        if (changed < 0) {
+            error = tr("Unable to write to %1.").arg(patchName);
+            return;
+        }
+
+    } else {
+        emit progress(0, 0, tr("Saving %1...").arg(fileName));
+
+        // write everything to the actual file
+        changed = rom.saveROM();
+        if (changed < 0) {
+            error = tr("Unable to write to %1.").arg(fileName);
+            return;
+        }
+
+        savedROM = rom.view();
+    }
+
+    result = saved;
+}
+
+/*
+  Gets the uncompressed data for every room and tileset and compresses it.
+  Normal (or fast decode) compression is used first. If that doesn't leave enough space
+  for everything, the biggest chunks are compressed again with optimal compression,
+  a few more at a time, until everything fits (or there's nothing left to try).
+  Chunks are returned sorted by size.
+*/
+bool SaveJob::pack(std::list<DataChunk>& chunks) {
+    // 0x12 banks available, first one has the first 0xA00 bytes used by palettes)
+    const uint freeSpace = (BANK_SIZE * lastBank) - dataStart.addr;
+
+    // keep track of the amount of free space left
+    uint usedSpace;
+    uint usedBanks;
+    uint bankSpace;
+
+    // chunks (by type and number) to use optimal compression for
+    std::set<std::pair<int, uint> > optimal;
+    uint retrySize = optimalRetrySize;
+
+    while (true) {
+        chunks.clear();
+        usedSpace = 0;
+        usedBanks = 0;
+        bankSpace = BANK_SIZE - dataStart.addr;
+
+        // get uncompressed level and sprite data
+        for (uint i = 0; i < NUM_LEVELS; i++) {
+            chunks.push_back(packLevel(&data.levels[i], i, data.hasExtra));
+            chunks.push_back(packSprites(&data.levels[i], i));
+        }
+        // get uncompressed tilesets
+        for (uint i = 0; i < NUM_TILESETS; i++) {
+            chunks.push_back(packTileset(i, data.tilesets));
+        }
+        // dummy-ish entry representing all three CHR bank tables consecutively
+        // (they must be stored in the same PRG bank, and the uncompressed data is already
+        //  stored elsewhere)
+        chunks.push_back(DataChunk(NULL, 0x300, DataChunk::banks, 0));
+
+        // compress everything
+        // (anything that was already compressed the same way on an earlier pass is
+        //  just taken from the cache)
+        packChunks(chunks, packMode, optimal);
+        if (isCancelled())
+            return false;
+
+        for (std::list<DataChunk>::const_iterator i = chunks.begin(); i != chunks.end(); i++) {
+            usedSpace += i->size;
+            if (i->size > bankSpace) {
+                usedBanks++;
+                bankSpace = BANK_SIZE;
+            }
+            bankSpace -= i->size;
+        }
+
+        if ((usedSpace > freeSpace || usedBanks >= lastBank) && packMode != PACK_OPTIMAL) {
+            // find the biggest chunks that haven't been optimally compressed yet
+            std::vector<const DataChunk*> bigger;
+            for (std::list<DataChunk>::const_iterator i = chunks.begin(); i != chunks.end(); i++) {
+                if ((i->type == DataChunk::level || i->type == DataChunk::tileset)
+                        && !optimal.count(std::make_pair((int)i->type, i->num)))
+                    bigger.push_back(&*i);
+            }
+            if (!bigger.empty()) {
+                std::sort(bigger.begin(), bigger.end(),
+                          [](const DataChunk *a, const DataChunk *b) { return *b < *a; });
+                if (bigger.size() > retrySize)
+                    bigger.resize(retrySize);
+
+                for (std::vector<const DataChunk*>::const_iterator i = bigger.begin(); i != bigger.end(); i++)
+                    optimal.insert(std::make_pair((int)(*i)->type, (*i)->num));
+                // try twice as many next time, if this still isn't enough
+                retrySize *= 2;
+
+                emit progress(0, 0, tr("Not enough free space in ROM, retrying the %n largest "
+                                       "chunk(s) with optimal compression...", 0, (int)bigger.size()));
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    // find the room which should take the longest for the game to decompress
+    // (going by the estimated cost from unpack_cycles)
+    for (std::list<DataChunk>::const_iterator i = chunks.begin(); i != chunks.end(); i++) {
+        if (i->type != DataChunk::level)
+            continue;
+
+        uint cycles = unpack_cycles(i->data.data(), i->size);
+        if (cycles > slowestCycles) {
+            slowestCycles = cycles;
+            slowestRoom = i->num;
+        }
+    }
+
+    // forget about old versions of anything that changed since the last save
+    packCache.prune();
+    if (!packCachePath.isEmpty())
+        packCache.save(packCachePath);
+
+    // panic if there's too much space
+    if (usedSpace > freeSpace) {
+        error = tr("Not enough free space in ROM (%1 bytes available, %2 bytes used).")
+                .arg(freeSpace).arg(usedSpace);
+        return false;
+    }
+    // or if some free space couldn't be used
+    else if (usedBanks >= lastBank) {
+        error = tr("Unable to save all level data because not all individual free space segments "
+                   "would be large enough. Try reducing the size of some map or sprite data and "
+                   "trying again.");
+        return false;
+    }
+
+    // sort packed chunks
+    chunks.sort();
+
+    // panic if something is bigger than it can/should be
+    if (chunks.back().size > BANK_SIZE) {
+        const DataChunk& chunk = chunks.back();
+
+        error = tr("Something exceeded 0x2000 bytes somehow (type %1, num %2, size %3).")
+                .arg(chunk.type).arg(chunk.num).arg(chunk.size);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+  Compresses all level and tileset data chunks using the thread pool.
+  All data used by the chunks has already been copied into them
+  (by packLevel, packTileset, etc.) so nothing else is touched by the pool.
+  Chunks listed in "optimal" use optimal compression instead of the given mode.
+  Chunks whose data hasn't changed since they were last compressed are taken from
+  the cache instead of being compressed again.
+*/
+void SaveJob::packChunks(std::list<DataChunk>& chunks, int mode,
+                         const std::set<std::pair<int, uint> >& optimal) {
+    std::vector<std::pair<DataChunk*, int> > toPack;
+    std::vector<QByteArray> keys;
+
+    for (std::list<DataChunk>::iterator i = chunks.begin(); i != chunks.end(); i++) {
+        if (i->type != DataChunk::level && i->type != DataChunk::tileset)
+            continue;
+
+        const int chunkMode = optimal.count(std::make_pair((int)i->type, i->num)) ? PACK_OPTIMAL : mode;
+        QByteArray key = ChunkCache::key(*i, chunkMode);
+        if (!packCache.get(key, *i)) {
+            toPack.push_back(std::make_pair(&*i, chunkMode));
+            keys.push_back(key);
+        }
+    }
+
+    if (toPack.empty())
+        return;
+
+    const int total = toPack.size();
+    const QString text = optimal.empty() ? tr("Compressing level data...")
+                                         : tr("Compressing level data (optimal)...");
+    packed.storeRelease(0);
+    emit progress(0, total, text);
+
+    QtConcurrent::blockingMap(toPack, [this, total, &text](const std::pair<DataChunk*, int>& chunk) {
+        // (anything left over after cancelling is just skipped)
+        if (isCancelled())
+            return;
+
+        chunk.first->pack(chunk.second);
+        emit progress(packed.fetchAndAddOrdered(1) + 1, total, text);
+    });
+
+    // don't keep anything that might not have actually been compressed
+    if (isCancelled())
+        return;
+
+    for (uint i = 0; i < toPack.size(); i++) {
+        packCache.put(keys[i], *toPack[i].first);
+    }
+}
+
+/*
+  Writes all compressed data (and everything else) to the ROM, which is still only
+  in memory at this point. The biggest chunks are placed first, and each bank is
+  filled with whatever still fits in it.
+*/
+bool SaveJob::write(ROMFile& rom, std::list<DataChunk>& chunks) {
+    romaddr_t nextAddr = dataStart;
+    const int total = chunks.size();
+
+    while (chunks.size()) {
+        if (isCancelled())
+            return false;
+        emit progress(total - chunks.size(), total, tr("Writing level data..."));
+
+        // find biggest chunk that will fit in the current ROM bank
+        uint space = BANK_SIZE - (nextAddr.addr % BANK_SIZE);
+
+        for (std::list<DataChunk>::reverse_iterator i = chunks.rbegin(); i != chunks.rend(); i++) {
+            if (space >= i->size) {
+                DataChunk& chunk = *i;
+
+                switch (chunk.type) {
+                case DataChunk::level:
+                    // save level data
+                    saveLevel(rom, chunk, &data.levels[chunk.num], nextAddr);
+                    break;
+                case DataChunk::enemy:
+                    // save enemy/sprite data
+                    saveSprites(rom, chunk, nextAddr);
+                    break;
+                case DataChunk::tileset:
+                    // save tileset data
+                    saveTileset(rom, chunk, nextAddr, data.tileSubtract);
+                    break;
+                case DataChunk::banks:
+                    saveBankTables(rom, nextAddr, data.bankTable);
+                    break;
+                }
+
+                nextAddr.addr += chunk.size;
+                // will the smallest available next chunk still fit in this bank?
+                if (space < chunk.size + chunks.front().size) {
+                    nextAddr.bank++;
+                    nextAddr.addr = 0;
+                }
+
+                chunks.erase((++i).base());
+                break;
+            }
+        }
+    }
+
+    // save all level exits (in level order instead of by size so pointers can be
+    // calculated correctly)
+    for (uint i = 0; i < NUM_LEVELS; i++) {
+        saveExits(rom, &data.levels[i], i);
+    }
+
+    // save map clear data for overworlds
+    for (uint i = 0; i < 7; i++) {
+        saveMapClearData(rom, &data.levels[i], i, data.mapClearData);
+    }
+
+    // save palettes
+    savePalettes(rom, data.palettes, data.sprPalettes);
+
+    // terrible hack to fix a likely off-by-one error in the game itself which causes
+    // screen 15 to always have no collision. i'm doing this in a very hacky way right
+    // now and i hope to be able to move this into something nicer if i ever end up
+    // having to make more behind-the-scenes code changes, like the switch location fix
+    // which there isn't enough free ROM space to cleanly insert :(
+    // fixes issue #6 (and doesn't break anything else, i hope)
+    const romaddr_t screenCollisionMax[] = {
+        {0x3f, 0xf75d}, // most versions
+        {0x3f, 0xf77a}, // canada
+        {0x3f, 0xf777}  // japan
+    };
+    for (uint i = 0; i < 3; i++) {
+        if (rom.readByte(screenCollisionMax[i]) == 0x74) {
+            rom.writeByte(screenCollisionMax[i], 0x75);
+            break;
+        }
+    }
+
+    return true;
+}
+
+/*
+  Decodes every room from what was just written and makes sure it matches what was
+  meant to be saved, so a problem with compressing or placing data can't end up in
+  the saved file.
+*/
+bool SaveJob::verify(const ROMView& rom) {
+    for (uint i = 0; i < NUM_LEVELS; i++) {
+        if (isCancelled())
+            return false;
+        emit progress(i, NUM_LEVELS, tr("Checking saved data..."));
+
+        const leveldata_t& level = data.levels[i];
+        leveldata_t *saved = loadLevel(rom, i);
+
+        bool same = saved
+                && saved->header.screensH == level.header.screensH
+                && saved->header.screensV == level.header.screensV
+                && saved->tileset == level.tileset
+                && saved->exits.size() == level.exits.size();
+
+        for (uint v = 0; same && v < level.header.screensV; v++) {
+            for (uint h = 0; same && h < level.header.screensH; h++) {
+                uint8_t tiles[SCREEN_SIZE], savedTiles[SCREEN_SIZE];
+                level.tiles.readScreen(h, v, tiles);
+                saved->tiles.readScreen(h, v, savedTiles);
+                same = !memcmp(tiles, savedTiles, SCREEN_SIZE);
+            }
+        }
+
+        delete saved;
+
+        if (!same) {
+            error = tr("Room %1 could not be read back correctly after saving. "
+                       "The file has not been changed.").arg(hexFormat(i, 3));
+            return false;
+        }
+    }
+
+    return true;
+}
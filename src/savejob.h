@@ -0,0 +1,91 @@
+/*
+    This code is released under the terms of the MIT license.
+    See COPYING.txt for details.
+*/
+
+#ifndef SAVEJOB_H
+#define SAVEJOB_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QRect>
+#include <QString>
+#include <list>
+#include <set>
+#include <utility>
+#include <vector>
+#include "romfile.h"
+#include "level.h"
+#include "tileset.h"
+#include "graphics.h"
+#include "chunkcache.h"
+
+/*
+  Copy of everything that gets written to the ROM when saving, taken when the save
+  starts so that the editor can keep being used while the save is running.
+  (Levels share their data with the editor's copies until either one is changed.)
+*/
+struct saveData_t {
+    std::vector<leveldata_t> levels;
+    bool               hasExtra;
+    metatile_t         tilesets[NUM_TILESETS][0x100];
+    uint8_t            tileSubtract[NUM_TILESETS];
+    uint8_t            bankTable[3][256];
+    uint8_t            palettes[BG_PAL_SIZE][BG_PAL_NUM];
+    uint8_t            sprPalettes[SPR_PAL_NUM][SPR_PAL_SIZE];
+    std::vector<QRect> mapClearData[7][16];
+};
+
+/*
+  Compresses, allocates and writes all level data to a ROM on a worker thread,
+  then checks what was written before saving the ROM (or a patch).
+  Nothing is written to disk until every other step has succeeded, so cancelling
+  a save at any point leaves the file alone.
+*/
+class SaveJob : public QObject {
+    Q_OBJECT
+
+public:
+    enum result_e {
+        saved, cancelled, failed
+    };
+
+    SaveJob(const QString& fileName, const QString& patchName, int packMode,
+            const ChunkCache& packCache, const QString& packCachePath);
+
+    // filled in by the caller before the job is started
+    saveData_t data;
+
+    void run();
+    void cancel();
+
+    const QString fileName, patchName;
+
+    // results (valid once the job has finished)
+    result_e   result;
+    QString    error;
+    int        changed;
+    uint       slowestRoom, slowestCycles;
+    ROMView    savedROM;
+    ChunkCache packCache;
+
+signals:
+    void progress(int value, int maximum, const QString& text);
+
+private:
+    bool isCancelled() const;
+    bool pack(std::list<DataChunk>& chunks);
+    void packChunks(std::list<DataChunk>& chunks, int mode,
+                    const std::set<std::pair<int, uint> >& optimal);
+    bool write(ROMFile& rom, std::list<DataChunk>& chunks);
+    bool verify(const ROMView& rom);
+
+    QString packCachePath;
+    int     packMode;
+
+    // number of chunks compressed so far in the current pass
+    QAtomicInt packed;
+    QAtomicInt cancelFlag;
+};
+
+#endif // SAVEJOB_H
@@ -1,6 +1,6 @@
 /*
  * QGraphicsItem that represents an object (sprite/exit) in the level.
- * Contains a pointer to the thing itself, which it manipulates when the user interacts
+ * Contains the ID of the thing itself, which it manipulates when the user interacts
  * with the item in some way (dragging around to move, or double/clicking to edit.)
  * No graphics are implmented, so just appears as an immobile rectangle.
  * Item info is shown in the tooltip.
@@ -95,15 +95,20 @@ QVariant SceneItem::itemChange(GraphicsItemChange change, const QVariant& value)
     return QGraphicsItem::itemChange(change, value);
 }
 
-ExitItem::ExitItem(exit_t *exit):
+ExitItem::ExitItem(leveldata_t *level, uint id):
     SceneItem()
 {
-    this->exit = exit;
+    this->level = level;
+    this->id = id;
 
     this->updateItem();
 
 }
 
+const exit_t* ExitItem::exit() const {
+    return level->exits.find(id);
+}
+
 QColor ExitItem::color(bool selected) {
     if (selected)
         return SceneItem::selectedColor;
@@ -112,11 +117,22 @@ QColor ExitItem::color(bool selected) {
 }
 
 void ExitItem::updateObject() {
-    this->exit->x = this->x() / TILE_SIZE;
-    this->exit->y = this->y() / TILE_SIZE;
+    uint x = this->x() / TILE_SIZE;
+    uint y = this->y() / TILE_SIZE;
+
+    // (only change the level if the item actually moved)
+    const exit_t *current = this->exit();
+    if (!current || (current->x == x && current->y == y)) return;
+
+    exit_t *exit = level->exits.modify(id);
+    exit->x = x;
+    exit->y = y;
 }
 
 void ExitItem::updateItem() {
+    const exit_t *exit = this->exit();
+    if (!exit) return;
+
     this->setPos(exit->x * TILE_SIZE, exit->y * TILE_SIZE);
 
     this->setToolTip(QString("Exit to level %1 (screen %2, %3, %4)\nType %5")
@@ -127,7 +143,10 @@ void ExitItem::updateItem() {
 }
 
 void ExitItem::editItem() {
-    ExitEditWindow win(NULL, this->exit);
+    exit_t *exit = level->exits.modify(id);
+    if (!exit) return;
+
+    ExitEditWindow win(NULL, exit);
     if (win.exec()) {
         // TODO: redo item undo/redo
     }
@@ -135,14 +154,19 @@ void ExitItem::editItem() {
     updateItem();
 }
 
-SpriteItem::SpriteItem(sprite_t *sprite) :
+SpriteItem::SpriteItem(leveldata_t *level, uint id) :
     SceneItem()
 {
-    this->sprite = sprite;
+    this->level = level;
+    this->id = id;
 
     this->updateItem();
 }
 
+const sprite_t* SpriteItem::sprite() const {
+    return level->sprites.find(id);
+}
+
 QColor SpriteItem::color(bool selected) {
     if (selected)
         return SceneItem::selectedColor;
@@ -151,17 +175,31 @@ QColor SpriteItem::color(bool selected) {
 }
 
 void SpriteItem::updateObject() {
-    this->sprite->x = this->x() / TILE_SIZE;
-    this->sprite->y = this->y() / TILE_SIZE;
+    uint x = this->x() / TILE_SIZE;
+    uint y = this->y() / TILE_SIZE;
+
+    // (only change the level if the item actually moved)
+    const sprite_t *current = this->sprite();
+    if (!current || (current->x == x && current->y == y)) return;
+
+    sprite_t *sprite = level->sprites.modify(id);
+    sprite->x = x;
+    sprite->y = y;
 }
 
 void SpriteItem::updateItem() {
+    const sprite_t *sprite = this->sprite();
+    if (!sprite) return;
+
     this->setPos(sprite->x * TILE_SIZE, sprite->y * TILE_SIZE);
     this->setToolTip(QString("Sprite %1").arg(spriteType(sprite->type)));
 }
 
 void SpriteItem::editItem() {
-    SpriteEditWindow win(NULL, this->sprite);
+    sprite_t *sprite = level->sprites.modify(id);
+    if (!sprite) return;
+
+    SpriteEditWindow win(NULL, sprite);
     if (win.exec()) {
         // TODO: redo item undo/redo
     }
@@ -30,12 +30,15 @@ protected:
 class ExitItem : public SceneItem
 {
 public:
-    ExitItem(exit_t*);
+    ExitItem(leveldata_t*, uint);
 
     static const QColor fillColor;
     QColor color(bool selected);
 
-    exit_t *exit;
+    const exit_t* exit() const;
+
+    leveldata_t *level;
+    uint id;
 
 protected:
     void updateObject();
@@ -47,12 +50,15 @@ protected:
 class SpriteItem : public SceneItem
 {
 public:
-    SpriteItem(sprite_t*);
+    SpriteItem(leveldata_t*, uint);
 
     static const QColor fillColor;
     QColor color(bool selected);
 
-    sprite_t *sprite;
+    const sprite_t* sprite() const;
+
+    leveldata_t *level;
+    uint id;
 
 protected:
     void updateObject();
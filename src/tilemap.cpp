@@ -0,0 +1,128 @@
+/*
+  tilemap.cpp
+
+  Contains the tile data for a level, stored as a grid of (possibly shared) screens.
+
+  This code is released under the terms of the MIT license.
+  See COPYING.txt for details.
+*/
+
+#include <cstring>
+
+#include "tilemap.h"
+
+/*
+  Returns the tile at a position (or 0 if there's nothing there.)
+*/
+uint8_t TileMap::at(uint x, uint y) const {
+    if (!grid || x >= MAX_SCREENS * SCREEN_WIDTH || y >= MAX_SCREENS * SCREEN_HEIGHT)
+        return 0;
+
+    const screen_t *screen = grid->screens[y / SCREEN_HEIGHT][x / SCREEN_WIDTH].constData();
+    return screen ? screen->tiles[y % SCREEN_HEIGHT][x % SCREEN_WIDTH] : 0;
+}
+
+/*
+  Changes the tile at a position. If the screen it's on is shared with anything,
+  it gets its own copy of that screen first.
+*/
+void TileMap::set(uint x, uint y, uint8_t tile) {
+    if (x >= MAX_SCREENS * SCREEN_WIDTH || y >= MAX_SCREENS * SCREEN_HEIGHT)
+        return;
+
+    // don't bother creating an empty screen just to put nothing on it
+    if (!tile && (!grid || !grid.constData()->screens[y / SCREEN_HEIGHT][x / SCREEN_WIDTH]))
+        return;
+    if (!grid)
+        grid = new screenGrid_t;
+
+    QSharedDataPointer<screen_t>& screen = grid->screens[y / SCREEN_HEIGHT][x / SCREEN_WIDTH];
+    if (!screen) {
+        screen = new screen_t;
+        memset(screen->tiles, 0, SCREEN_SIZE);
+    }
+
+    screen->tiles[y % SCREEN_HEIGHT][x % SCREEN_WIDTH] = tile;
+}
+
+/*
+  Copies all tiles on a screen to a SCREEN_SIZE buffer.
+*/
+void TileMap::readScreen(uint h, uint v, uint8_t *tiles) const {
+    const screen_t *screen = !grid ? NULL : grid->screens[v][h].constData();
+    if (screen)
+        memcpy(tiles, screen->tiles, SCREEN_SIZE);
+    else
+        memset(tiles, 0, SCREEN_SIZE);
+}
+
+/*
+  Replaces all tiles on a screen from a SCREEN_SIZE buffer.
+*/
+void TileMap::setScreen(uint h, uint v, const uint8_t *tiles) {
+    screen_t *screen = new screen_t;
+    memcpy(screen->tiles, tiles, SCREEN_SIZE);
+
+    if (!grid)
+        grid = new screenGrid_t;
+    grid->screens[v][h] = screen;
+}
+
+/*
+  Makes a screen use the same tiles as another one (until either of them changes.)
+*/
+void TileMap::shareScreen(uint h, uint v, uint fromH, uint fromV) {
+    if (!grid)
+        grid = new screenGrid_t;
+    grid->screens[v][h] = grid.constData()->screens[fromV][fromH];
+}
+
+/*
+  Returns true if two screens have the same tiles.
+*/
+bool TileMap::sameScreen(uint h, uint v, uint otherH, uint otherV) const {
+    if (!grid)
+        return true;
+
+    const screen_t *screen = grid->screens[v][h].constData();
+    const screen_t *other  = grid->screens[otherV][otherH].constData();
+
+    if (screen == other)
+        return true;
+
+    uint8_t tiles[SCREEN_SIZE], otherTiles[SCREEN_SIZE];
+    readScreen(h, v, tiles);
+    readScreen(otherH, otherV, otherTiles);
+    return !memcmp(tiles, otherTiles, SCREEN_SIZE);
+}
+
+/*
+  Returns true if two screens are currently sharing the same tiles
+  (i.e. from shareScreen, or copying the whole TileMap.)
+*/
+bool TileMap::sharesScreen(uint h, uint v, uint otherH, uint otherV) const {
+    if (!grid)
+        return true;
+
+    return grid->screens[v][h].constData() == grid->screens[otherV][otherH].constData();
+}
+
+/*
+  Returns a hash of all tiles on a screen, for finding screens that might be the same
+  without comparing every tile. (Screens with the same tiles always have the same hash.)
+*/
+uint64_t TileMap::screenHash(uint h, uint v) const {
+    uint64_t tiles[SCREEN_SIZE / sizeof(uint64_t)];
+    readScreen(h, v, (uint8_t*)tiles);
+
+    // FNV-1a, 8 tiles at a time
+    // (with the high bits folded back down, since each step only carries upward)
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint i = 0; i < SCREEN_SIZE / sizeof(uint64_t); i++) {
+        hash ^= tiles[i];
+        hash *= 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
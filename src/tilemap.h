@@ -0,0 +1,106 @@
+/*
+    This code is released under the terms of the MIT license.
+    See COPYING.txt for details.
+*/
+
+#ifndef TILEMAP_H
+#define TILEMAP_H
+
+#include <QSharedData>
+#include <QSharedDataPointer>
+#include <cstdint>
+
+#define SCREEN_WIDTH  16
+#define SCREEN_HEIGHT 12
+#define SCREEN_SIZE   (SCREEN_HEIGHT * SCREEN_WIDTH)
+
+// maximum number of screens in each direction
+#define MAX_SCREENS   16
+
+/*
+  Converting between positions in a level and screen numbers, for a level
+  that's "width" screens wide. (Sprites use screens that are 16 tiles tall
+  instead of 12, so they can pass a different height.)
+*/
+inline uint screenNum(uint x, uint y, uint width, uint height = SCREEN_HEIGHT) {
+    return (y / height * width) + (x / SCREEN_WIDTH);
+}
+inline uint screenLeft(uint screen, uint width) {
+    return screen % width * SCREEN_WIDTH;
+}
+inline uint screenTop(uint screen, uint width, uint height = SCREEN_HEIGHT) {
+    return screen / width * height;
+}
+
+struct screen_t : public QSharedData {
+    uint8_t tiles[SCREEN_HEIGHT][SCREEN_WIDTH];
+};
+
+struct screenGrid_t : public QSharedData {
+    QSharedDataPointer<screen_t> screens[MAX_SCREENS][MAX_SCREENS];
+};
+
+/*
+  Tile data for a level.
+  This is stored the same way the game does it: as a grid of screens, each of
+  which may be shared with other screens (or other copies of the level) until
+  one of them is changed. Screens that have never had anything on them aren't
+  stored at all. The grid itself is shared too, so copying a TileMap is cheap.
+
+  Tiles can still be accessed as tiles[y][x], or with at()/set().
+*/
+class TileMap {
+public:
+    // a single tile (so that "tiles[y][x] = tile" only changes one screen)
+    class Tile {
+    public:
+        Tile(TileMap *map, uint x, uint y) : map(map), x(x), y(y) {}
+
+        operator uint8_t() const { return map->at(x, y); }
+        Tile& operator=(uint8_t tile) { map->set(x, y, tile); return *this; }
+        Tile& operator=(const Tile& other) { return *this = (uint8_t)other; }
+
+    private:
+        TileMap *map;
+        uint    x, y;
+    };
+
+    class Row {
+    public:
+        Row(TileMap *map, uint y) : map(map), y(y) {}
+        Tile operator[](uint x) const { return Tile(map, x, y); }
+
+    private:
+        TileMap *map;
+        uint    y;
+    };
+
+    class ConstRow {
+    public:
+        ConstRow(const TileMap *map, uint y) : map(map), y(y) {}
+        uint8_t operator[](uint x) const { return map->at(x, y); }
+
+    private:
+        const TileMap *map;
+        uint          y;
+    };
+
+    Row      operator[](uint y)       { return Row(this, y); }
+    ConstRow operator[](uint y) const { return ConstRow(this, y); }
+
+    uint8_t at(uint x, uint y) const;
+    void    set(uint x, uint y, uint8_t tile);
+
+    // whole screens (by column and row)
+    void readScreen(uint h, uint v, uint8_t *tiles) const;
+    void setScreen(uint h, uint v, const uint8_t *tiles);
+    void shareScreen(uint h, uint v, uint fromH, uint fromV);
+    bool sameScreen(uint h, uint v, uint otherH, uint otherV) const;
+    bool sharesScreen(uint h, uint v, uint otherH, uint otherV) const;
+    uint64_t screenHash(uint h, uint v) const;
+
+private:
+    QSharedDataPointer<screenGrid_t> grid;
+};
+
+#endif // TILEMAP_H
@@ -10,56 +10,65 @@ const romaddr_t tileSubVals = {0x12, 0x9c5f};
 metatile_t tilesets[NUM_TILESETS][0x100];
 uint8_t    tileSubtract[NUM_TILESETS];
 
-void loadTilesets(ROMFile& rom) {
+/*
+  Decodes all tilesets from the ROM (into the global tilesets by default.)
+*/
+void loadTilesets(const ROMView& rom, metatile_t (*sets)[0x100], uint8_t *subtract) {
     uint8_t tileset[DATA_SIZE];
     uint8_t *palettes = tileset + 0x400;
     uint8_t *behavior = tileset + 0x440;
 
+    const PointerTable& pointers = rom.pointerTable(ptrTilesetL, ptrTilesetH, ptrTilesetB, NUM_TILESETS);
     for (uint set = 0; set < NUM_TILESETS; set++) {
-        rom.readFromPointer(ptrTilesetL, ptrTilesetH, ptrTilesetB, 0, tileset, set);
+        rom.readFromPointer(pointers, 0, tileset, set);
 
         for (uint tile = 0; tile < 0x100; tile++) {
-            tilesets[set][tile].ul      = tileset[tile*4 + 0];
-            tilesets[set][tile].ur      = tileset[tile*4 + 1];
-            tilesets[set][tile].ll      = tileset[tile*4 + 2];
-            tilesets[set][tile].lr      = tileset[tile*4 + 3];
-            tilesets[set][tile].palette = (palettes[tile / 4] >> (3 - tile%4)*2) & 3;
-            tilesets[set][tile].action  = behavior[tile];
+            sets[set][tile].ul      = tileset[tile*4 + 0];
+            sets[set][tile].ur      = tileset[tile*4 + 1];
+            sets[set][tile].ll      = tileset[tile*4 + 2];
+            sets[set][tile].lr      = tileset[tile*4 + 3];
+            sets[set][tile].palette = (palettes[tile / 4] >> (3 - tile%4)*2) & 3;
+            sets[set][tile].action  = behavior[tile];
         }
 
         if (set < NUM_TILESETS_INGAME)
-            tileSubtract[set] = rom.readByte(tileSubVals + set);
+            subtract[set] = rom.readByte(tileSubVals + set);
     }
 }
 
-DataChunk packTileset(uint num) {
+/*
+  Gets the uncompressed data for a tileset (from a copy of all tilesets made when saving.)
+*/
+DataChunk packTileset(uint num, const metatile_t (*sets)[0x100]) {
     uint8_t buf[DATA_SIZE] = {0};
     uint8_t *palettes = buf + 0x400;
     uint8_t *behavior = buf + 0x440;
 
     for (uint tile = 0; tile < 0x100; tile++) {
-        buf[tile*4 + 0] = tilesets[num][tile].ul;
-        buf[tile*4 + 1] = tilesets[num][tile].ur;
-        buf[tile*4 + 2] = tilesets[num][tile].ll;
-        buf[tile*4 + 3] = tilesets[num][tile].lr;
+        buf[tile*4 + 0] = sets[num][tile].ul;
+        buf[tile*4 + 1] = sets[num][tile].ur;
+        buf[tile*4 + 2] = sets[num][tile].ll;
+        buf[tile*4 + 3] = sets[num][tile].lr;
 
-        palettes[tile/4] |= tilesets[num][tile].palette << (3 - tile%4)*2;
-        behavior[tile] = tilesets[num][tile].action;
+        palettes[tile/4] |= sets[num][tile].palette << (3 - tile%4)*2;
+        behavior[tile] = sets[num][tile].action;
     }
 
     return DataChunk(buf, 0x540, DataChunk::tileset, num);
 }
 
-void saveTileset(ROMFile& file, const DataChunk &chunk, romaddr_t addr) {
+void saveTileset(ROMFile& file, const DataChunk &chunk, romaddr_t addr,
+                 const uint8_t *subtract) {
     //data banks mapped to A000-BFFF
     addr.addr %= BANK_SIZE;
     addr.addr += 0xA000;
 
     // save compressed data chunk, update pointer table
     uint num = chunk.num;
-    file.writeToPointer(ptrTilesetL, ptrTilesetH, ptrTilesetB, addr, chunk.size, chunk.data, num);
+    file.writeToPointer(file.pointerTable(ptrTilesetL, ptrTilesetH, ptrTilesetB, NUM_TILESETS),
+                        addr, chunk.size, chunk.data.data(), num);
 
     // save destroyable value
     if (num < NUM_TILESETS_INGAME)
-        file.writeByte(tileSubVals + num, tileSubtract[num]);
+        file.writeByte(tileSubVals + num, subtract[num]);
 }
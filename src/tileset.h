@@ -17,8 +17,10 @@ extern metatile_t tilesets[NUM_TILESETS][0x100];
 // (rest of tilesets are null / not useful)
 extern uint8_t    tileSubtract[NUM_TILESETS];
 
-void      loadTilesets(ROMFile &);
-DataChunk packTileset(uint num);
-void      saveTileset(ROMFile& file, const DataChunk &chunk, romaddr_t addr);
+void      loadTilesets(const ROMView &, metatile_t (*sets)[0x100] = tilesets,
+                       uint8_t *subtract = tileSubtract);
+DataChunk packTileset(uint num, const metatile_t (*sets)[0x100]);
+void      saveTileset(ROMFile& file, const DataChunk &chunk, romaddr_t addr,
+                      const uint8_t *subtract);
 
 #endif // TILESET_H